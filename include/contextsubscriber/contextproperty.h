@@ -29,18 +29,25 @@
 class ContextPropertyPrivate;
 class ContextPropertyInfo;
 
+namespace statefs { namespace qt { class Key; }}
+
 class ContextProperty : public QObject
 {
     Q_OBJECT
 
 public:
     explicit ContextProperty(const QString &key, QObject *parent = 0);
+    explicit ContextProperty(statefs::qt::Key const &key, QObject *parent = 0);
 
     virtual ~ContextProperty();
 
     QString key() const;
     QVariant value(const QVariant &def) const;
     QVariant value() const;
+    /// Changed each time value is updated from the provider, 0 before
+    /// the first update. Can be compared to check if value is changed
+    /// since some moment without comparing values
+    quint64 generation() const;
 
     const ContextPropertyInfo* info() const;
 
@@ -50,6 +57,12 @@ public:
     void waitForSubscription() const;
     void waitForSubscription(bool block) const;
 
+    /// Limit rate of valueChanged() notifications: not more often
+    /// than once per interval ms and/or only after value is not
+    /// changed for debounce ms. The latest value is delivered when
+    /// the limit expires.
+    void setRateLimit(int interval, int debounce = 0);
+
     static void ignoreCommander();
     static void setTypeCheck(bool typeCheck);
 
@@ -7,11 +7,29 @@
  * @par License: LGPL 2.1 http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html
  */
 
+#include <statefs/qt/util.hpp>
+
 #include <QObject>
 #include <QVariant>
 
 namespace statefs { namespace qt {
 
+/// Property monitor statistics (process-wide)
+struct MonitorStats
+{
+    /// number of property reads (change notifications, refreshes)
+    quint64 updates;
+    /// reads skipped before decoding because data was not changed
+    quint64 unchanged;
+    /// subscribers attached to properties
+    quint64 targets;
+};
+
+MonitorStats monitorStats();
+
+void setReadBufferLimit(size_t);
+void setMonitorThreads(size_t);
+
 class DiscretePropertyImpl;
 
 class DiscreteProperty : public QObject
@@ -19,6 +37,7 @@ class DiscreteProperty : public QObject
     Q_OBJECT;
 public:
     DiscreteProperty(QString const &, QObject *parent = nullptr);
+    DiscreteProperty(Key const &, QObject *parent = nullptr);
     ~DiscreteProperty();
 
     void refresh() const;
@@ -37,9 +56,11 @@ class PropertyWriter : public QObject
     Q_OBJECT;
 public:
     PropertyWriter(QString const &, QObject *parent = nullptr);
+    PropertyWriter(Key const &, QObject *parent = nullptr);
     ~PropertyWriter();
 
     void set(QVariant);
+    void setFlushInterval(int);
 signals:
     void updated(bool);
 private:
@@ -0,0 +1,72 @@
+#ifndef _STATEFS_QT_SNAPSHOT_HPP_
+#define _STATEFS_QT_SNAPSHOT_HPP_
+/**
+ * @file snapshot.hpp
+ * @brief Bulk read of statefs namespace
+ * @copyright (C) 2013-2014 Jolla Ltd.
+ * @par License: LGPL 2.1 http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html
+ */
+
+#include <QString>
+#include <QVariant>
+#include <QHash>
+
+namespace statefs { namespace qt {
+
+/**
+ * @addtogroup util
+ *
+ * @{
+ */
+
+/**
+ * Current values of all properties in the namespace. Namespace
+ * directory is enumerated once and property files are read in
+ * parallel by the small worker pool, without subscription:
+ *
+ * @code
+ * auto snapshot = statefs::qt::Snapshot::read("Battery");
+ * for (auto it = snapshot.values().begin(); ...)
+ *     qDebug() << it.key() << it.value();
+ * @endcode
+ */
+class Snapshot
+{
+public:
+    /// full property key -> decoded value
+    typedef QHash<QString, QVariant> Values;
+
+    struct Stats
+    {
+        /// number of properties read
+        int count;
+        /// number of property files failed to be read
+        int failed;
+        /// number of threads used to read properties
+        int threads;
+        /// time spent to enumerate namespace directory
+        qint64 list_ns;
+        /// time spent to read and decode properties
+        qint64 read_ns;
+    };
+
+    static Snapshot read(QString const &ns);
+
+    Values const & values() const { return values_; }
+    Stats const & stats() const { return stats_; }
+    bool isEmpty() const { return values_.isEmpty(); }
+
+    QVariant value(QString const &key) const { return values_.value(key); }
+
+private:
+    Snapshot();
+
+    Values values_;
+    Stats stats_;
+};
+
+/// @}
+
+}}
+
+#endif // _STATEFS_QT_SNAPSHOT_HPP_
@@ -10,9 +10,14 @@
 #include <QObject>
 #include <QString>
 #include <QStringList>
+#include <QVariant>
+#include <QVector>
+#include <QMetaType>
 #include <QFile>
 
 #include <errno.h>
+#include <string.h>
+#include <cstddef>
 #include <memory>
 
 namespace statefs { namespace qt {
@@ -26,10 +31,181 @@ class WriterImpl;
  * @{
  */
 
+/**
+ * Property key known at compile time (string literal). Namespace and
+ * property name boundaries are calculated by the compiler, so there
+ * is no parsing at runtime:
+ *
+ * @code
+ * static constexpr statefs::qt::Key charge("Battery.ChargePercentage");
+ * static_assert(charge.isValid(), "Wrong key");
+ * ContextProperty p(charge);
+ * @endcode
+ *
+ * Key only refers to the literal, so it should not be constructed
+ * from a temporary character array.
+ */
+class Key
+{
+public:
+    template <size_t N>
+    explicit constexpr Key(char const (&name)[N])
+        : name_(name)
+        , size_(N - 1)
+        , name_pos_(lastSeparator(name, N - 1) + 1)
+        , ns_begin_(nsBegin(name, N - 1))
+        , ns_has_separators_(firstSeparator(name, nsBegin(name, N - 1)
+                                            , lastSeparator(name, N - 1))
+                             != npos)
+    {}
+
+    constexpr bool isValid() const { return name_pos_ != 0; }
+
+    QString key() const;
+    QString ns() const;
+    QString name() const;
+
+private:
+    static constexpr size_t npos = ~size_t(0);
+
+    static constexpr bool isSeparator(char c)
+    {
+        return c == '.' || c == '/';
+    }
+
+    static constexpr size_t lastSeparator(char const *s, size_t end)
+    {
+        return (!end
+                ? npos
+                : (isSeparator(s[end - 1]) ? end - 1 : lastSeparator(s, end - 1)));
+    }
+
+    static constexpr size_t firstSeparator(char const *s, size_t pos, size_t end)
+    {
+        return (pos >= end || end == npos
+                ? npos
+                : (isSeparator(s[pos]) ? pos : firstSeparator(s, pos + 1, end)));
+    }
+
+    // leading separator is skipped for names like "/a/b/c"
+    static constexpr size_t nsBegin(char const *s, size_t size)
+    {
+        return (size && isSeparator(s[0])
+                && firstSeparator(s, 0, size) != lastSeparator(s, size)
+                ? 1 : 0);
+    }
+
+    char const *name_;
+    size_t size_;
+    size_t name_pos_;
+    size_t ns_begin_;
+    bool ns_has_separators_;
+};
+
+/**
+ * Property key split to the namespace and property name once. It
+ * can be constructed from Key without any parsing.
+ */
+class PropertyKey
+{
+public:
+    PropertyKey() : is_valid_(false) {}
+    explicit PropertyKey(QString const &);
+    PropertyKey(Key const &);
+
+    bool isValid() const { return is_valid_; }
+    QString const &key() const { return key_; }
+    QString const &ns() const { return ns_; }
+    QString const &name() const { return name_; }
+
+private:
+    QString key_;
+    QString ns_;
+    QString name_;
+    bool is_valid_;
+};
+
+/**
+ * Value encoded to the UTF-8 data (see valueEncode()) without heap
+ * allocations for numeric values
+ */
+class EncodedValue
+{
+public:
+    enum { max_inline_size = 32 };
+
+    explicit EncodedValue(QVariant const &);
+
+    char const *data() const { return data_; }
+    int size() const { return size_; }
+
+    bool operator ==(QByteArray const &other) const
+    {
+        return (size_ == other.size()
+                && !::memcmp(data_, other.constData(), size_));
+    }
+
+private:
+    EncodedValue(EncodedValue const &);
+    EncodedValue &operator =(EncodedValue const &);
+
+    char buf_[max_inline_size];
+    QByteArray bytes_;
+    char const *data_;
+    int size_;
+};
+
+/**
+ * Implicitly shared property data kept as a sequence of chunks as it
+ * was read from the file. Large values (e.g. JSON documents) can be
+ * declared with blobType() to be read without decoding and parsed
+ * incrementally by consumers:
+ *
+ * @code
+ * setPropertyType("Ns.Document", blobType());
+ * ...
+ * auto blob = property.value().value<statefs::qt::Blob>();
+ * for (auto const &chunk : blob.chunks())
+ *     parser.feed(chunk);
+ * @endcode
+ */
+class Blob
+{
+public:
+    Blob() : size_(0) {}
+    explicit Blob(QByteArray const &);
+
+    QVector<QByteArray> const & chunks() const { return chunks_; }
+    int size() const { return size_; }
+    bool isEmpty() const { return !size_; }
+
+    void append(QByteArray const &);
+    QByteArray toByteArray() const;
+
+    bool operator ==(Blob const &) const;
+    bool operator !=(Blob const &other) const { return !(*this == other); }
+    bool operator <(Blob const &other) const { return compare(other) < 0; }
+
+private:
+    int compare(Blob const &) const;
+
+    QVector<QByteArray> chunks_;
+    int size_;
+};
+
+int blobType();
+
+/// How Writer/InOutWriter access property file
+enum class WriteMode {
+    Reopen, ///< file is opened and closed on each set()
+    Persistent ///< file is kept opened, unchanged values are skipped
+};
+
 class Writer
 {
 public:
     Writer(const QString&);
+    Writer(const QString&, WriteMode);
     virtual ~Writer();
 
     bool exists() const;
@@ -42,11 +218,22 @@ protected:
 bool splitPropertyName(const QString &, QStringList &);
 QString getPath(const QString &);
 QString getSystemPath(const QString &);
+QString getPath(PropertyKey const &);
+QString getSystemPath(PropertyKey const &);
+QString getNamespacesRoot();
+QString getSystemNamespacesRoot();
 
 QVariant valueDecode(QString const&);
+QVariant valueDecode(QString const&, int);
+QVariant valueDecodeRaw(char const *, size_t, int type = QVariant::Invalid);
 QString valueEncode(QVariant const&);
+int valueEncode(QVariant const&, char *, size_t);
 QVariant valueDefault(QVariant const&);
 
+void setPropertyType(QString const &, int);
+int getPropertyType(QString const &);
+int getPropertyType(PropertyKey const &);
+
 /// @}
 
 /**
@@ -59,6 +246,7 @@ class InOutWriter
 {
 public:
     InOutWriter(const QString&);
+    InOutWriter(const QString&, WriteMode);
     virtual ~InOutWriter();
 
     bool exists() const;
@@ -72,4 +260,6 @@ protected:
 
 }}
 
+Q_DECLARE_METATYPE(statefs::qt::Blob)
+
 #endif // _STATEFS_QT_UTIL_HPP_
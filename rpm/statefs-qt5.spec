@@ -80,7 +80,8 @@ Requires:   %{name} = %{version}-%{release}
 %setup -q
 
 %build
-%cmake -DVERSION=%{version} %{?_with_multiarch:-DENABLE_MULTIARCH=ON}
+%cmake -DVERSION=%{version} %{?_with_multiarch:-DENABLE_MULTIARCH=ON} \
+    -DENABLE_TOUCH_WORKAROUND=OFF
 make %{?_smp_mflags}
 make doc
 
@@ -112,6 +113,7 @@ make doc
 %files %{subscriber_devel}
 %defattr(-,root,root,-)
 %{_includedir}/contextproperty.h
+%{_includedir}/contextpropertyinfo.h
 %{_libdir}/pkgconfig/contextkit-statefs.pc
 %{_libdir}/pkgconfig/contextsubscriber-1.0.pc
 
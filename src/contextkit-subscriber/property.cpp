@@ -8,19 +8,34 @@
 #include <qtaround/util.hpp>
 
 #include <contextproperty.h>
+#include <contextpropertyinfo.h>
 #include <QDebug>
 #include <QTimer>
+#include <QThread>
 #include <QSocketNotifier>
 #include <QMutex>
+#include <QReadWriteLock>
+#include <QHash>
+#include <algorithm>
+#include <array>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 
 namespace debug = qtaround::debug;
 
 class ContextPropertyPrivateHandle
 {
 public:
-    ContextPropertyPrivateHandle(QString const &key)
+    ContextPropertyPrivateHandle(statefs::qt::PropertyKey const &key)
         : impl_(new ContextPropertyPrivate(key))
     {}
     virtual ~ContextPropertyPrivateHandle()
@@ -88,7 +103,7 @@ class DiscretePropertyImpl : public QObject
 {
     Q_OBJECT;
 public:
-    DiscretePropertyImpl(QString const &, QObject *parent = nullptr);
+    DiscretePropertyImpl(PropertyKey const &, QObject *parent = nullptr);
     ~DiscretePropertyImpl();
 
     void refresh() const;
@@ -103,19 +118,27 @@ class PropertyWriterImpl : public QObject
 {
     Q_OBJECT;
 public:
-    PropertyWriterImpl(QString const &);
+    PropertyWriterImpl(PropertyKey const &);
     ~PropertyWriterImpl() {}
 
     void set(QVariant &&);
+    void setFlushInterval(int);
     virtual bool event(QEvent *);
 
 signals:
     void updated(bool);
+private slots:
+    void flush();
 private:
     friend class PropertyWriter;
     void detach();
+    void post();
     QSharedPointer<PropertyWriterImpl> handle_;
-    QString key_;
+    PropertyKey key_;
+    QVariant pending_;
+    bool has_pending_;
+    bool is_writing_;
+    QTimer *flush_timer_;
 };
 
 }}
@@ -133,7 +156,8 @@ public:
         Write,
         Refresh,
         WriteStatus,
-        Ready
+        Ready,
+        Dispatch
     };
 
     virtual ~Event();
@@ -154,35 +178,236 @@ void File::close()
     }
 }
 
-qint64 File::read(QByteArray &dst, size_t size, size_t offset)
+/**
+ * read data from the file at the offset, file position is not
+ * used, so there is no need to seek before reading
+ */
+qint64 File::read(char *dst, size_t size, off_t offset)
 {
-    qint64 res = 0;
-    if (file_) {
-        if ((size_t)dst.size() < offset + size) {
-            debug::warning("Logical error: wrong dst QByteArray size");
-        } else {
-            res = file_->read(dst.data() + offset, size);
+    return file_ ? ::pread(file_->handle(), dst, size, offset) : 0;
+}
+
+/**
+ * Per-process cache of statefs namespace directories. Namespace
+ * directory of each root (session or system statefs instance) is
+ * opened once and the root property was found in last time is
+ * remembered, so property is usually opened with a single openat()
+ * call. The other root is tried only if file is not found.
+ */
+class NamespaceDirs
+{
+public:
+    NamespaceDirs();
+    ~NamespaceDirs();
+
+    static NamespaceDirs &instance();
+
+    int open(QString const &, QByteArray const &, int, File::Type &);
+
+private:
+    struct Dirs
+    {
+        std::array<int, File::System + 1> fds;
+        // root to look for the file first
+        File::Type type;
+    };
+
+    int root(File::Type);
+    int dir(Dirs &, QString const &, File::Type);
+    void closeDir(Dirs &, File::Type);
+    int resolve(Dirs &, QString const &, QByteArray const &, int
+                , File::Type &);
+
+    // files are opened by monitor threads concurrently, the lock is
+    // taken for writing only to open or close directories
+    QReadWriteLock lock_;
+    std::array<QByteArray, File::System + 1> root_paths_;
+    std::array<int, File::System + 1> roots_;
+    QHash<QString, Dirs> dirs_;
+};
+
+NamespaceDirs::NamespaceDirs()
+{
+    root_paths_[File::User] = QFile::encodeName(getNamespacesRoot());
+    root_paths_[File::System] = QFile::encodeName(getSystemNamespacesRoot());
+    roots_.fill(-1);
+}
+
+NamespaceDirs::~NamespaceDirs()
+{
+    for (auto const &dirs : dirs_)
+        for (auto fd : dirs.fds)
+            if (fd >= 0)
+                ::close(fd);
+    for (auto fd : roots_)
+        if (fd >= 0)
+            ::close(fd);
+}
+
+NamespaceDirs &NamespaceDirs::instance()
+{
+    static NamespaceDirs self;
+    return self;
+}
+
+int NamespaceDirs::root(File::Type t)
+{
+    if (roots_[t] < 0)
+        roots_[t] = ::open(root_paths_[t].constData()
+                           , O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return roots_[t];
+}
+
+namespace {
+
+/// directory is removed or statefs is restarted (fuse is remounted)
+bool isStaleDir(int fd)
+{
+    struct stat st;
+    return ::fstat(fd, &st) < 0 || !st.st_nlink;
+}
+
+}
+
+/**
+ * @return cached or just opened namespace directory descriptor in the
+ * root or -1 (errno is set)
+ */
+int NamespaceDirs::dir(Dirs &dirs, QString const &ns, File::Type t)
+{
+    if (dirs.fds[t] >= 0)
+        return dirs.fds[t];
+
+    auto root_fd = root(t);
+    if (root_fd < 0)
+        return -1;
+    auto fd = ::openat(root_fd, QFile::encodeName(ns).constData()
+                       , O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT && isStaleDir(root_fd)) {
+        auto err = errno;
+        ::close(root_fd);
+        roots_[t] = -1;
+        errno = err;
+    }
+    dirs.fds[t] = fd;
+    return fd;
+}
+
+void NamespaceDirs::closeDir(Dirs &dirs, File::Type t)
+{
+    if (dirs.fds[t] >= 0)
+        ::close(dirs.fds[t]);
+    dirs.fds[t] = -1;
+}
+
+/**
+ * open property file relative to the cached namespace directory
+ *
+ * @param ns namespace name
+ * @param name property file name (encoded)
+ * @param flags open(2) flags
+ * @param type output parameter: statefs instance file belongs to
+ *
+ * @return file descriptor or -1 (errno is set)
+ */
+int NamespaceDirs::open(QString const &ns, QByteArray const &name
+                        , int flags, File::Type &type)
+{
+    {
+        QReadLocker lock(&lock_);
+        auto it = dirs_.find(ns);
+        if (it != dirs_.end()) {
+            auto t = it->type;
+            auto dir_fd = it->fds[t];
+            if (dir_fd >= 0) {
+                auto fd = ::openat(dir_fd, name.constData()
+                                   , flags | O_CLOEXEC);
+                if (fd >= 0) {
+                    type = t;
+                    return fd;
+                }
+            }
         }
     }
-    return res;
+
+    QWriteLocker lock(&lock_);
+    auto it = dirs_.find(ns);
+    if (it == dirs_.end()) {
+        Dirs dirs;
+        dirs.fds.fill(-1);
+        dirs.type = File::User;
+        it = dirs_.insert(ns, dirs);
+    }
+    return resolve(it.value(), ns, name, flags, type);
+}
+
+/**
+ * look for the file in both roots starting from the one it was found
+ * in last time, remember the root file is found in. Directories are
+ * checked for being stale (removed or statefs is restarted) only if
+ * file is not found
+ */
+int NamespaceDirs::resolve(Dirs &dirs, QString const &ns
+                           , QByteArray const &name, int flags
+                           , File::Type &type)
+{
+    auto err = ENOENT;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        auto other = (dirs.type == File::User ? File::System : File::User);
+        for (auto t : {dirs.type, other}) {
+            auto dir_fd = dir(dirs, ns, t);
+            if (dir_fd < 0) {
+                if (errno != ENOENT)
+                    err = errno;
+                continue;
+            }
+            auto fd = ::openat(dir_fd, name.constData(), flags | O_CLOEXEC);
+            if (fd >= 0) {
+                dirs.type = t;
+                type = t;
+                return fd;
+            }
+            // ENOENT is not reported if there is other error
+            if (errno != ENOENT || err == ENOENT)
+                err = errno;
+        }
+
+        auto is_stale = false;
+        for (auto t : {File::User, File::System}) {
+            if (dirs.fds[t] >= 0 && isStaleDir(dirs.fds[t])) {
+                closeDir(dirs, t);
+                is_stale = true;
+            }
+        }
+        if (!is_stale)
+            break;
+    }
+    errno = err;
+    return -1;
 }
 
-File::File(QString const &key)
+File::File(PropertyKey const &key)
     : type_(File::User)
     , key_(key)
+    , file_name_(QFile::encodeName(key.name()))
     , failures_count_(0)
+    , error_(0)
 {
 }
 
-QString File::getError(file_ptr const &f) const
+QString File::getError() const
 {
-    return (!f
-            ? "No file"
-            : (f->isOpen()
-               ? QString()
-               : (!f->exists()
-                  ? "No file"
-                  : "No access")));
+    switch (error_) {
+    case 0:
+        return QString();
+    case ENOENT:
+        return "No file";
+    case EACCES:
+    case EPERM:
+        return "No access";
+    default:
+        return ::strerror(error_);
+    }
 }
 
 QString File::nameFor(Type t) const
@@ -192,49 +417,66 @@ QString File::nameFor(Type t) const
             : statefs::qt::getSystemPath(key_));
 }
 
-File::files_type File::openNew(QIODevice::OpenMode mode)
+File::file_ptr File::openNew(QIODevice::OpenMode mode)
 {
-    auto open = [](QIODevice::OpenMode mode, QString const &name) {
-        auto res = cor::make_unique<QFile>(name);
-        res->open(mode);
-        if (res->isOpen())
-            debug::debug("Opened", res->fileName());
-        return std::move(res);
-    };
-    files_type res;
-    auto f = open(mode, nameFor(type_));
-    if (!f->isOpen()) {
-        type_ = (type_ == System ? User : System);
-        f = open(mode, nameFor(type_));
-        if (!f->isOpen())
-            f.reset();
+    int flags = O_RDONLY;
+    if (mode & QIODevice::WriteOnly)
+        flags = ((mode & QIODevice::ReadOnly)
+                 ? O_RDWR
+                 : O_WRONLY | O_TRUNC);
+
+    file_ptr res;
+    auto fd = NamespaceDirs::instance().open
+        (key_.ns(), file_name_, flags, type_);
+    if (fd < 0) {
+        error_ = errno;
+        return res;
+    }
+    res = cor::make_unique<QFile>();
+    if (!res->open(fd, mode, QFileDevice::AutoCloseHandle)) {
+        ::close(fd);
+        error_ = EBADF;
+        res.reset();
+        return res;
     }
-    res[type_] = std::move(f);
-    return std::move(res);
+    error_ = 0;
+    debug::debug("Opened", key(), type_);
+    return res;
+}
+
+/**
+ * just open and close property file, can be used to make vfs reread
+ * file data
+ */
+void File::touch() const
+{
+    auto type = type_;
+    auto fd = NamespaceDirs::instance().open
+        (key_.ns(), file_name_, O_RDONLY, type);
+    if (fd >= 0)
+        ::close(fd);
 }
 
 bool File::tryOpen(QIODevice::OpenMode mode)
 {
     if (file_) {
         if (!file_->isOpen()) {
-            debug::warning("Property", key_, "is missed"
-                           , getError(file_));
+            debug::warning("Property", key(), "is missed"
+                           , getError());
             close();
         }
     }
     if (!file_) {
-        auto files = openNew(mode);
-        if (files[type_]) {
-            file_ = std::move(files[type_]);
+        file_ = openNew(mode);
+        if (file_) {
             failures_count_ = 0;
         } else {
             type_ = User;
             if (!failures_count_++) {
-                debug::warning("Can't open property", key_
-                               , "Sys:", getError(files[System])
-                               , "User:", getError(files[User]));
+                debug::warning("Can't open property", key()
+                               , getError());
             } else {
-                debug::info("Failed try #", failures_count_, "to access", key_);
+                debug::info("Failed try #", failures_count_, "to access", key());
             }
         }
     }
@@ -247,20 +489,30 @@ void FileReader::close()
     File::close();
 }
 
-bool FileWriter::write(QByteArray const &data)
+/**
+ * writer can be reused, so data is always written at the beginning
+ * of the file, file is truncated only if new data is shorter than
+ * previously written
+ */
+bool FileWriter::write(char const *data, int size)
 {
     bool res = false;
     QString reason;
     if (!file_) {
         reason = "File is not opened for " + key();
     } else {
-        auto len = file_->write(data);
-        if (len == data.size()) {
+        auto fd = handle();
+        auto len = ::pwrite(fd, data, size, 0);
+        if (len == size) {
+            if (size < last_size_ && ::ftruncate(fd, size))
+                debug::warning("Can't truncate", fileName()
+                               , ::strerror(errno));
+            last_size_ = size;
             res = true;
         } else {
             reason = QString("Wrong len returned: %1 (vs %2) for %3. Error '%4'")
-                .arg(len).arg(data.size()).arg(file_->fileName())
-                .arg(file_->error());
+                .arg(len).arg(size).arg(fileName())
+                .arg(::strerror(errno));
         }
     }
     if (!res)
@@ -269,19 +521,188 @@ bool FileWriter::write(QByteArray const &data)
     return res;
 }
 
-std::once_flag PropertyMonitor::once_;
-PropertyMonitor::monitor_ptr PropertyMonitor::instance_;
+std::atomic<size_t> PropertyMonitor::requested_shards_(0);
+std::once_flag PropertyMonitor::shards_once_;
+size_t PropertyMonitor::shards_count_ = 1;
+std::array<std::once_flag, PropertyMonitor::max_shards> PropertyMonitor::once_;
+std::array<PropertyMonitor::monitor_ptr, PropertyMonitor::max_shards>
+PropertyMonitor::instances_;
+std::array<std::unique_ptr<CommandQueue>, PropertyMonitor::max_shards>
+PropertyMonitor::queues_;
+MonitorCounters Property::stats_;
+
+/**
+ * @return statistics of property updates performed by the monitor
+ * in this process
+ */
+MonitorStats monitorStats()
+{
+    MonitorStats res;
+    res.updates = Property::stats_.updates;
+    res.unchanged = Property::stats_.unchanged;
+    res.targets = Property::stats_.targets;
+    return res;
+}
+
+/**
+ * set number of monitor threads, should be called before any property
+ * is accessed. 0 means default: number of cores
+ */
+void setMonitorThreads(size_t count)
+{
+    PropertyMonitor::setShardsCount(count);
+}
+
+void PropertyMonitor::setShardsCount(size_t count)
+{
+    requested_shards_ = count;
+}
+
+/**
+ * Number of shards is fixed when it is requested the first time,
+ * count can be also set by STATEFS_QT_MONITOR_THREADS environment
+ * variable
+ */
+size_t PropertyMonitor::shardsCount()
+{
+    std::call_once(shards_once_, []() {
+            size_t count = requested_shards_;
+            auto env = ::getenv("STATEFS_QT_MONITOR_THREADS");
+            if (!count && env)
+                count = ::strtoul(env, nullptr, 10);
+            if (!count)
+                count = std::max(QThread::idealThreadCount(), 1);
+            shards_count_ = std::min<size_t>(count, max_shards);
+        });
+    return shards_count_;
+}
+
+/**
+ * properties are distributed between shards by namespace, so
+ * namespace with frequently changed properties does not delay
+ * properties from other namespaces
+ */
+size_t PropertyMonitor::shard(PropertyKey const &key)
+{
+    auto count = shardsCount();
+    return count > 1 ? qHash(key.ns()) % count : 0;
+}
 
-PropertyMonitor::monitor_ptr PropertyMonitor::instance()
+PropertyMonitor::monitor_ptr PropertyMonitor::instance(PropertyKey const &key)
 {
     namespace mt = qtaround::mt;
-    std::call_once(once_, []() {
+    auto i = shard(key);
+    std::call_once(once_[i], [i]() {
             using statefs::qt::PropertyMonitor;
-            auto ctor = []() { return make_qobject_unique<PropertyMonitor>(); };
-            instance_ = mt::startActorSync<PropertyMonitor>(ctor);
-            mt::deleteOnApplicationExit(instance_);
+            queues_[i].reset(new CommandQueue());
+            auto queue = queues_[i].get();
+            auto ctor = [queue]() {
+                return make_qobject_unique<PropertyMonitor>(queue);
+            };
+            instances_[i] = mt::startActorSync<PropertyMonitor>(ctor);
+            mt::deleteOnApplicationExit(instances_[i]);
         });
-    return instance_;
+    return instances_[i];
+}
+
+/**
+ * pass command to the monitor thread responsible for the key,
+ * monitor takes ownership
+ */
+void PropertyMonitor::post(PropertyKey const &key, Command *cmd)
+{
+    instance(key);
+    queues_[shard(key)]->push(cmd);
+}
+
+CommandQueue::CommandQueue()
+    : head_(&stub_)
+    , tail_(&stub_)
+    , stub_(Command::Subscribe)
+    , is_signaled_(false)
+    , fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (fd_ < 0)
+        debug::warning("Can't create eventfd:", ::strerror(errno));
+}
+
+CommandQueue::~CommandQueue()
+{
+    while (auto cmd = pop())
+        delete cmd;
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+void CommandQueue::link(Command *cmd)
+{
+    cmd->next_.store(nullptr, std::memory_order_relaxed);
+    auto prev = head_.exchange(cmd, std::memory_order_acq_rel);
+    prev->next_.store(cmd, std::memory_order_release);
+}
+
+/// can be called from any thread
+void CommandQueue::push(Command *cmd)
+{
+    link(cmd);
+    wake();
+}
+
+void CommandQueue::wake()
+{
+    // pairs with the fence in reset(): either consumer sees the
+    // command linked before or the flag is seen cleared here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!is_signaled_.exchange(true)) {
+        uint64_t v = 1;
+        if (::write(fd_, &v, sizeof(v)) != sizeof(v))
+            debug::warning("Can't signal eventfd:", ::strerror(errno));
+    }
+}
+
+/// called by consumer before draining the queue
+void CommandQueue::reset()
+{
+    uint64_t v;
+    if (::read(fd_, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        debug::warning("Can't read eventfd:", ::strerror(errno));
+    is_signaled_.exchange(false);
+    // flag should be cleared before the queue is drained, otherwise
+    // producer can skip signaling while its command is not seen
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+/**
+ * called only by consumer
+ *
+ * @return next command or nullptr if queue is empty or producer has
+ * not finished linking the command yet (it will signal eventfd after
+ * that)
+ */
+Command *CommandQueue::pop()
+{
+    auto tail = tail_;
+    auto next = tail->next_.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+        if (!next)
+            return nullptr;
+        tail_ = tail = next;
+        next = next->next_.load(std::memory_order_acquire);
+    }
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    if (tail != head_.load(std::memory_order_acquire))
+        return nullptr;
+
+    link(&stub_);
+    next = tail->next_.load(std::memory_order_acquire);
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    return nullptr;
 }
 
 
@@ -291,43 +712,147 @@ Event::Event(Event::Type t)
 
 Event::~Event() {}
 
-class ReplyEvent : public Event
+/**
+ * Memory for frequently posted messages (events and commands) is
+ * taken from the free list. Messages are allocated by one thread and
+ * released by the other one: released memory is pushed to the shared
+ * lock-free stack, allocating thread takes the whole stack at once
+ * to its own list when the list is empty. Nodes are never popped one
+ * by one from the shared stack, so there is no ABA problem.
+ */
+template <typename T>
+class Pooled
 {
 public:
-    ReplyEvent(Event::Type t, target_handle const &tgt)
-        : Event(t)
-        , tgt_(tgt)
-    {}
+    static void *operator new(size_t size)
+    {
+        static_assert(sizeof(T) >= sizeof(Node), "Too small to be pooled");
+        auto p = (size == sizeof(T) ? take() : nullptr);
+        return p ? p : ::operator new(size);
+    }
 
-    target_handle tgt_;
+    static void operator delete(void *p, size_t size)
+    {
+        if (size != sizeof(T) || !put(p))
+            ::operator delete(p);
+    }
+
+private:
+    enum { max_count = 1024 };
+    struct Node { Node *next; };
+
+    // nodes taken by the allocating thread, released on thread exit
+    class Local
+    {
+    public:
+        Local() : free_(nullptr) {}
+        ~Local()
+        {
+            while (free_) {
+                auto node = free_;
+                free_ = node->next;
+                ::operator delete(node);
+            }
+        }
+
+        Node *free_;
+    };
+
+    static Local &local()
+    {
+        static thread_local Local self;
+        return self;
+    }
+
+    static void *take()
+    {
+        auto &list = local();
+        auto res = list.free_;
+        if (!res) {
+            res = shared_.exchange(nullptr, std::memory_order_acquire);
+            if (!res)
+                return nullptr;
+            size_t count = 0;
+            for (auto node = res; node; node = node->next)
+                ++count;
+            count_.fetch_sub(count, std::memory_order_relaxed);
+        }
+        list.free_ = res->next;
+        return res;
+    }
+
+    static bool put(void *p)
+    {
+        if (count_.fetch_add(1, std::memory_order_relaxed) >= max_count) {
+            count_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto node = static_cast<Node*>(p);
+        node->next = shared_.load(std::memory_order_relaxed);
+        while (!shared_.compare_exchange_weak
+               (node->next, node, std::memory_order_release
+                , std::memory_order_relaxed)) {}
+        return true;
+    }
+
+    // constant-initialized and trivially destructible, so messages
+    // can be released during the static objects destruction
+    static std::atomic<Node*> shared_;
+    // approximate number of nodes in the shared stack
+    static std::atomic<size_t> count_;
 };
 
+template <typename T>
+std::atomic<typename Pooled<T>::Node*> Pooled<T>::shared_(nullptr);
+
+template <typename T>
+std::atomic<size_t> Pooled<T>::count_(0);
 
-class DataReadyEvent : public ReplyEvent
+/**
+ * Posted to the subscriber when property data is changed. Only one
+ * event per subscriber is in flight (see
+ * ContextPropertyPrivate::update_queued_)
+ */
+class DataReadyEvent : public Event, public Pooled<DataReadyEvent>
 {
 public:
-    DataReadyEvent(target_handle const &tgt)
-        : ReplyEvent(Event::Ready, tgt)
-    {}
+    DataReadyEvent() : Event(Event::Ready) {}
+};
+
+/**
+ * Wakes up the thread change dispatcher, only one event per
+ * dispatcher is in flight
+ */
+class DispatchEvent : public Event, public Pooled<DispatchEvent>
+{
+public:
+    DispatchEvent() : Event(Event::Dispatch) {}
 };
 
-class SubscribeRequest : public Event
+class SubscribeRequest : public Command, public Pooled<SubscribeRequest>
 {
 public:
     SubscribeRequest(target_handle tgt
-                    , QString const&key
-                    , std::promise<QVariant> &&res)
-        : Event(Event::Subscribe)
+                    , PropertyKey const &key
+                    , dispatcher_handle const &dispatcher
+                    , RateLimit const &limit)
+        : Command(Command::Subscribe)
         , tgt_(tgt)
         , key_(key)
-        , value_(std::move(res))
+        , dispatcher_(dispatcher)
+        , limit_(limit)
+        , generation(0)
     {}
     virtual ~SubscribeRequest();
 
     target_handle tgt_;
-    QString key_;
-    std::promise<QVariant> value_;
+    PropertyKey key_;
+    // dispatcher of the subscribing thread
+    dispatcher_handle dispatcher_;
+    RateLimit limit_;
     QVariant result;
+    // generation of the result in the property cache
+    quint64 generation;
 
 private:
     SubscribeRequest(SubscribeRequest const&);
@@ -336,30 +861,30 @@ private:
 SubscribeRequest::~SubscribeRequest()
 {
     auto notify_fn = [this]() {
-        tgt_->dataReady(tgt_);
-        value_.set_value(result);
+        tgt_->dataReady();
+        tgt_->subscribed_value_ = std::move(result);
+        tgt_->subscribed_generation_ = generation;
+        tgt_->on_subscribed_.complete();
     };
     execute_nothrow(notify_fn, __PRETTY_FUNCTION__);
 }
 
-class UnsubscribeRequest : public Event
+class UnsubscribeRequest : public Command, public Pooled<UnsubscribeRequest>
 {
 public:
     UnsubscribeRequest(target_handle tgt
-                    , QString const &key
-                    , std::promise<void> &&done)
-        : Event(Event::Unsubscribe)
+                    , QString const &key)
+        : Command(Command::Unsubscribe)
         , tgt_(tgt)
         , key_(key)
-        , done_(std::move(done))
     {}
     virtual ~UnsubscribeRequest() {
-        done_.set_value();
+        if (tgt_)
+            tgt_->on_unsubscribed_.complete();
     }
 
     target_handle tgt_;
     QString key_;
-    std::promise<void> done_;
 };
 
 using statefs::qt::PropertyWriterImpl;
@@ -377,13 +902,13 @@ public:
     bool is_updated_;
 };
 
-class WriteRequest : public Event
+class WriteRequest : public Command, public Pooled<WriteRequest>
 {
 public:
     WriteRequest(QSharedPointer<PropertyWriterImpl> const &tgt
-                 , QString const &key
+                 , PropertyKey const &key
                  , QVariant &&value)
-        : Event(Event::Write)
+        : Command(Command::Write)
         , tgt_(tgt)
         , key_(key)
         , value_(std::move(value))
@@ -397,16 +922,16 @@ public:
     }
 
     QSharedPointer<PropertyWriterImpl> tgt_;
-    QString key_;
+    PropertyKey key_;
     QVariant value_;
 };
 
-class RefreshRequest : public Event
+class RefreshRequest : public Command, public Pooled<RefreshRequest>
 {
 public:
     RefreshRequest(target_handle tgt
                     , QString const &key)
-        : Event(Event::Refresh)
+        : Command(Command::Refresh)
         , tgt_(tgt)
         , key_(key)
     {}
@@ -416,184 +941,1206 @@ public:
     QString key_;
 };
 
-bool PropertyMonitor::event(QEvent *e)
+class ThrottleRequest : public Command, public Pooled<ThrottleRequest>
 {
-    if (e->type() < QEvent::User)
-        return QObject::event(e);
+public:
+    ThrottleRequest(target_handle tgt
+                    , QString const &key
+                    , RateLimit const &limit)
+        : Command(Command::Throttle)
+        , tgt_(tgt)
+        , key_(key)
+        , limit_(limit)
+    {}
+    virtual ~ThrottleRequest() {}
 
-    auto res = true;
-    auto fn = [this, e, &res]() {
-        auto t = static_cast<Event::Type>(e->type());
-        switch (t) {
-        case Event::Subscribe: {
-            auto p = EVENT_CAST(e, SubscribeRequest);
-            if (p) subscribe(p);
+    target_handle tgt_;
+    QString key_;
+    RateLimit limit_;
+};
+
+/**
+ * process commands posted to the monitor. Commands are processed in
+ * batches, if there are more commands, processing is continued on the
+ * next event loop iteration
+ */
+void PropertyMonitor::drain()
+{
+    static const int max_batch = 256;
+
+    queue_->reset();
+    for (int i = 0; i < max_batch; ++i) {
+        auto cmd = queue_->pop();
+        if (!cmd)
+            return;
+        dispatch(cmd);
+        delete cmd;
+    }
+    queue_->wake();
+}
+
+void PropertyMonitor::dispatch(Command *cmd)
+{
+    auto fn = [this, cmd]() {
+        switch (cmd->type()) {
+        case Command::Subscribe:
+            subscribe(static_cast<SubscribeRequest*>(cmd));
             break;
-        }
-        case Event::Unsubscribe: {
-            auto p = EVENT_CAST(e, UnsubscribeRequest);
-            if (p) unsubscribe(p);
+        case Command::Unsubscribe:
+            unsubscribe(static_cast<UnsubscribeRequest*>(cmd));
             break;
-        }
-        case Event::Write: {
-            auto p = EVENT_CAST(e, WriteRequest);
-            if (p) write(p);
+        case Command::Write:
+            write(static_cast<WriteRequest*>(cmd));
             break;
-        }
-        case Event::Refresh: {
-            auto p = EVENT_CAST(e, RefreshRequest);
-            if (p) refresh(p);
+        case Command::Refresh:
+            refresh(static_cast<RefreshRequest*>(cmd));
+            break;
+        case Command::Throttle:
+            throttle(static_cast<ThrottleRequest*>(cmd));
             break;
-        }
-        default:
-            debug::warning("Unknown user event");
-            res = QObject::event(e);
         }
     };
     execute_nothrow(fn, __PRETTY_FUNCTION__);
+}
+
+void PropertyMonitor::write(WriteRequest *req)
+{
+    auto isOk = false;
+    auto emit_on_exit = cor::on_scope_exit([req, &isOk]() {
+            emit req->updated(isOk);
+        });
+    // numeric values are encoded without heap allocations
+    EncodedValue data(req->value_);
+    // cached writer can be stale (e.g. statefs is restarted), so
+    // there is one more try with the newly opened file
+    for (auto attempt = 0; attempt < 2 && !isOk; ++attempt) {
+        auto dst = writer(req->key_);
+        if (!dst) {
+            debug::warning("Can't access", req->key_.key());
+            return;
+        }
+        isOk = dst->write(data.data(), data.size());
+        if (!isOk)
+            writers_.remove(req->key_.key());
+    }
+}
+
+/**
+ * @return opened writer for the property, writers are cached to
+ * avoid reopening files on each write. If there are too many cached
+ * writers the least recently used one is closed
+ */
+std::shared_ptr<FileWriter> PropertyMonitor::writer(PropertyKey const &key)
+{
+    static const int max_writers = 64;
+    auto it = writers_.find(key.key());
+    if (it != writers_.end()) {
+        it->used = ++writers_clock_;
+        return it->writer;
+    }
+
+    auto res = std::make_shared<FileWriter>(key);
+    if (!res->tryOpen())
+        return nullptr;
+
+    if (writers_.size() >= max_writers) {
+        auto lru = std::min_element
+            (writers_.begin(), writers_.end()
+             , [](CachedWriter const &a, CachedWriter const &b) {
+                return a.used < b.used;
+            });
+        writers_.erase(lru);
+    }
+    writers_.insert(key.key(), CachedWriter{res, ++writers_clock_});
     return res;
 }
 
-void PropertyMonitor::write(WriteRequest *req)
+void Property::changed()
+{
+    debug::debug("Notify", file_.key(), targets_count_, "targets in"
+                 , groups_.size(), "groups");
+    qint64 wait = 0;
+    auto now = clock_.elapsed();
+    for (auto const &group : groups_) {
+        auto left = group->changed(now);
+        if (left && (!wait || left < wait))
+            wait = left;
+    }
+    schedule(wait);
+}
+
+/// start timer to notify rate limited groups after wait ms
+void Property::schedule(qint64 wait)
+{
+    if (!wait)
+        return;
+    if (throttle_timer_->isActive()) {
+        auto left = throttle_timer_->remainingTime();
+        if (left >= 0 && left <= wait)
+            return;
+    }
+    throttle_timer_->start(wait);
+}
+
+void Property::flushThrottled()
+{
+    qint64 wait = 0;
+    auto now = clock_.elapsed();
+    for (auto const &group : groups_) {
+        auto left = group->flush(now);
+        if (left && (!wait || left < wait))
+            wait = left;
+    }
+    schedule(wait);
+}
+
+bool Property::add(target_handle const &target
+                   , dispatcher_handle const &dispatcher
+                   , RateLimit const &limit)
+{
+    TargetGroup::Key key{dispatcher.get(), limit};
+    auto &group = groups_[key];
+    if (!group)
+        group = std::make_shared<TargetGroup>(dispatcher, limit);
+    if (!group->add(target)) {
+        if (group->isEmpty())
+            groups_.remove(key);
+        return false;
+    }
+
+    target->attachCache(cache_);
+    ++targets_count_;
+    ++stats_.targets;
+    return true;
+}
+
+Property::Removed Property::remove(target_handle const &target)
+{
+    // there are only few groups: receiving threads x rate limits
+    for (auto it = groups_.begin(); it != groups_.end(); ++it) {
+        if (!it.value()->remove(target))
+            continue;
+        if (it.value()->isEmpty())
+            groups_.erase(it);
+        --stats_.targets;
+        return (--targets_count_ ? Removed::Yes : Removed::Last);
+    }
+    return Removed::No;
+}
+
+/// move subscriber to the group with the different rate limit
+void Property::setRateLimit(target_handle const &target, RateLimit const &limit)
+{
+    for (auto const &group : groups_) {
+        if (group->limit() == limit || !group->isMember(target))
+            continue;
+        // group can be released by remove()
+        auto dispatcher = group->dispatcher();
+        remove(target);
+        add(target, dispatcher, limit);
+        return;
+    }
+}
+
+namespace {
+
+/// receives wakeup events in the dispatcher thread
+class DispatchReceiver : public QObject
+{
+public:
+    DispatchReceiver(ChangeDispatcher *dispatcher)
+        : dispatcher_(dispatcher)
+    {}
+
+    virtual bool event(QEvent *e)
+    {
+        if (e->type() != static_cast<QEvent::Type>(Event::Dispatch))
+            return QObject::event(e);
+
+        execute_nothrow([this]() { dispatcher_->dispatch(); }
+                        , __PRETTY_FUNCTION__);
+        return true;
+    }
+
+private:
+    ChangeDispatcher *dispatcher_;
+};
+
+}
+
+/// thread reference to the dispatcher, detaches it on the thread exit
+class ChangeDispatcher::Thread
+{
+public:
+    Thread() : dispatcher_(new ChangeDispatcher()) {}
+    ~Thread() { dispatcher_->detach(); }
+
+    dispatcher_handle dispatcher_;
+};
+
+ChangeDispatcher::ChangeDispatcher()
+    : pending_(nullptr)
+    , receiver_(new DispatchReceiver(this))
+{
+}
+
+ChangeDispatcher::~ChangeDispatcher()
+{
+    // detached by the thread, it holds a reference while alive
+    release(pending_.exchange(nullptr));
+}
+
+dispatcher_handle const & ChangeDispatcher::instance()
+{
+    static thread_local Thread self;
+    return self.dispatcher_;
+}
+
+/// called from the dispatcher thread when it is finished
+void ChangeDispatcher::detach()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    delete receiver_;
+    receiver_ = nullptr;
+    release(pending_.exchange(nullptr));
+}
+
+/// drop self references of groups not to be delivered
+void ChangeDispatcher::release(TargetGroup *head)
+{
+    while (head) {
+        auto next = head->next_;
+        // is_queued_ is left set, so the group is not posted again
+        auto hold = std::move(head->self_);
+        head = next;
+    }
+}
+
+/// called from the monitor thread(s) to queue changed group
+void ChangeDispatcher::post(TargetGroup *group)
+{
+    auto head = pending_.load(std::memory_order_relaxed);
+    do {
+        group->next_ = head;
+    } while (!pending_.compare_exchange_weak
+             (head, group, std::memory_order_release
+              , std::memory_order_relaxed));
+    // list was not empty: dispatcher is already woken up
+    if (head)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (receiver_)
+        QCoreApplication::postEvent(receiver_, new DispatchEvent());
+    else
+        release(pending_.exchange(nullptr, std::memory_order_acquire));
+}
+
+void ChangeDispatcher::dispatch()
+{
+    // whole list is taken at once, so there is no ABA issue. Groups
+    // are pushed to the head, so the list is reversed to update
+    // properties in order of changes
+    auto head = pending_.exchange(nullptr, std::memory_order_acquire);
+    TargetGroup *ordered = nullptr;
+    while (head) {
+        auto next = head->next_;
+        head->next_ = ordered;
+        ordered = head;
+        head = next;
+    }
+
+    // all values are updated first, so subscribers see consistent
+    // state of other properties while handling notification
+    while (ordered) {
+        auto group = ordered;
+        ordered = group->next_;
+        group->deliver(changed_);
+    }
+    for (auto const &target : changed_)
+        emit target->valueChanged();
+    changed_.clear();
+}
+
+TargetGroup::TargetGroup(dispatcher_handle const &dispatcher
+                         , RateLimit const &limit)
+    : dispatcher_(dispatcher)
+    , limit_(limit)
+    , last_(std::numeric_limits<qint64>::min() / 2)
+    , deadline_(0)
+    , is_pending_(false)
+    , is_queued_(ATOMIC_FLAG_INIT)
+    , next_(nullptr)
+{
+}
+
+bool TargetGroup::add(target_handle const &target)
+{
+    QMutexLocker lock(&mutex_);
+    if (targets_.contains(target))
+        return false;
+    targets_.insert(target);
+    return true;
+}
+
+bool TargetGroup::remove(target_handle const &target)
+{
+    QMutexLocker lock(&mutex_);
+    return targets_.remove(target);
+}
+
+bool TargetGroup::isMember(target_handle const &target) const
+{
+    QMutexLocker lock(&mutex_);
+    return targets_.contains(target);
+}
+
+bool TargetGroup::isEmpty() const
+{
+    QMutexLocker lock(&mutex_);
+    return targets_.isEmpty();
+}
+
+void TargetGroup::dataReady()
+{
+    // seq_cst, see ContextPropertyPrivate::dataReady()
+    if (!is_queued_.test_and_set()) {
+        self_ = shared_from_this();
+        dispatcher_->post(this);
+    }
+}
+
+void TargetGroup::notify(qint64 now)
+{
+    last_ = now;
+    is_pending_ = false;
+    dataReady();
+}
+
+/**
+ * property is changed, notification is sent immediately or delayed
+ * if group is rate limited
+ *
+ * @return time (ms) left to send delayed notification, 0 if sent
+ */
+qint64 TargetGroup::changed(qint64 now)
+{
+    if (limit_.isEmpty()) {
+        dataReady();
+        return 0;
+    }
+    // debounce window is restarted on each change
+    auto deadline = std::max(now + limit_.debounce, last_ + limit_.interval);
+    if (deadline <= now) {
+        notify(now);
+        return 0;
+    }
+    is_pending_ = true;
+    deadline_ = deadline;
+    return deadline - now;
+}
+
+/**
+ * send delayed notification if the time has come, subscribers load
+ * the latest value from the cache
+ *
+ * @return time (ms) left to send delayed notification, 0 if nothing
+ * is delayed
+ */
+qint64 TargetGroup::flush(qint64 now)
+{
+    if (!is_pending_)
+        return 0;
+    if (deadline_ > now)
+        return deadline_ - now;
+    notify(now);
+    return 0;
+}
+
+/**
+ * update subscribers from the property cache
+ *
+ * @param changed subscribers to be notified are appended to it
+ */
+void TargetGroup::deliver(std::vector<target_handle> &changed)
+{
+    // self reference is released before group can be queued again
+    auto hold = std::move(self_);
+    is_queued_.clear();
+    // set is implicitly shared, so the lock is held only to take a
+    // reference, targets can be unsubscribed by the notified code
+    QSet<target_handle> targets;
+    {
+        QMutexLocker lock(&mutex_);
+        targets = targets_;
+    }
+    auto thread = QThread::currentThread();
+    for (auto const &target : targets) {
+        // target is moved to the other thread after subscription, so
+        // it is notified with its own event
+        if (target->thread() != thread)
+            target->dataReady();
+        else if (target->updateFromRemoteCache())
+            changed.push_back(target);
+    }
+}
+
+void PropertyMonitor::subscribe(SubscribeRequest *req)
+{
+    auto tgt = req->tgt_;
+    auto const &key = req->key_.key();
+    std::shared_ptr<Property> handler;
+    QVariant retval;
+
+    debug::debug("Subcribe request:", tgt, key);
+    if (!tgt) {
+        debug::warning("Logic issue: subscription target is null");
+        return;
+    }
+
+    if (key.isEmpty()) {
+        debug::warning("Empty contextkit key");
+        return;
+    }
+
+    auto it = properties_.find(key);
+    if (it == properties_.end()) {
+        handler = add(req->key_);
+    } else {
+        handler = it.value();
+    }
+    handler->add(tgt, req->dispatcher_, req->limit_);
+
+    req->result = handler->subscribe(req->generation);
+}
+
+void PropertyMonitor::unsubscribe(UnsubscribeRequest *req)
+{
+    auto tgt = req->tgt_;
+    auto key = req->key_;
+
+    debug::debug("Unsubcribe request:", tgt, key);
+
+    auto phandlers = properties_.find(key);
+    if (phandlers == properties_.end())
+        return;
+
+    auto handler = phandlers.value();
+
+    if (handler->remove(tgt) == Property::Removed::Last) {
+        // last subscriber is gone
+        properties_.erase(phandlers);
+    }
+}
+
+void PropertyMonitor::refresh(RefreshRequest *req)
+{
+    auto key = req->key_;
+    auto phandlers = properties_.find(key);
+    if (phandlers == properties_.end())
+        return;
+
+    auto handler = phandlers.value();
+    handler->update();
+}
+
+void PropertyMonitor::throttle(ThrottleRequest *req)
+{
+    auto phandlers = properties_.find(req->key_);
+    if (phandlers == properties_.end())
+        return;
+
+    phandlers.value()->setRateLimit(req->tgt_, req->limit_);
+}
+
+PropertyMonitor::PropertyMonitor(CommandQueue *queue)
+    : queue_(queue)
+    , queue_notifier_(new QSocketNotifier(queue->fd(), QSocketNotifier::Read))
+    , writers_clock_(0)
+{
+    connect(queue_notifier_.data(), &QSocketNotifier::activated
+            , this, &PropertyMonitor::drain);
+}
+
+PropertyMonitor::~PropertyMonitor()
+{
+    queue_notifier_.reset();
+    // not processed commands are just released
+    while (auto cmd = queue_->pop())
+        delete cmd;
+}
+
+std::shared_ptr<Property> PropertyMonitor::add(PropertyKey const &key)
+{
+    auto it = properties_.insert
+        (key.key(), make_qobject_shared<Property>
+         (key, this, &poller_, &watcher_));
+    return it.value();
+}
+
+namespace {
+
+/**
+ * Hazard pointer of the thread reading Cache: node it points to is
+ * not released by the writer. Slots are never freed, slot of the
+ * finished thread is reused by the next one
+ */
+struct HazardSlot
+{
+    std::atomic<void const*> ptr;
+    std::atomic<bool> is_used;
+    HazardSlot *next;
+};
+
+std::atomic<HazardSlot*> hazard_slots(nullptr);
+
+HazardSlot *acquireHazardSlot()
+{
+    for (auto p = hazard_slots.load(); p; p = p->next) {
+        bool is_used = false;
+        if (p->is_used.compare_exchange_strong(is_used, true))
+            return p;
+    }
+    auto res = new HazardSlot();
+    res->ptr.store(nullptr);
+    res->is_used.store(true);
+    auto head = hazard_slots.load();
+    do {
+        res->next = head;
+    } while (!hazard_slots.compare_exchange_weak(head, res));
+    return res;
+}
+
+class ThreadHazard
+{
+public:
+    ThreadHazard() : slot_(acquireHazardSlot()) {}
+    ~ThreadHazard()
+    {
+        slot_->ptr.store(nullptr);
+        slot_->is_used.store(false);
+    }
+
+    HazardSlot *slot_;
+};
+
+HazardSlot &hazardSlot()
+{
+    static thread_local ThreadHazard self;
+    return *self.slot_;
+}
+
+bool isHazard(void const *p)
+{
+    for (auto slot = hazard_slots.load(); slot; slot = slot->next)
+        if (slot->ptr.load() == p)
+            return true;
+    return false;
+}
+
+}
+
+std::atomic<quint64> Cache::last_generation_(0);
+
+Cache::Cache()
+    : current_(new Node{QVariant(), 0, nullptr})
+    , generation_(0)
+    , retired_(nullptr)
+    , spare_(nullptr)
+{
+}
+
+Cache::~Cache()
+{
+    // readers hold the cache, so there is no readers at this point
+    while (retired_) {
+        auto node = retired_;
+        retired_ = node->next;
+        delete node;
+    }
+    delete spare_;
+    delete current_.load();
+}
+
+void Cache::store(QVariant v)
+{
+    auto generation = ++last_generation_;
+    auto node = spare_;
+    spare_ = nullptr;
+    if (node) {
+        node->value = std::move(v);
+        node->generation = generation;
+    } else {
+        node = new Node{std::move(v), generation, nullptr};
+    }
+
+    // seq_cst to be sure hazard pointers are checked after the node
+    // is replaced: reader protecting the node later sees it is
+    // replaced and switches to the new one
+    auto prev = current_.exchange(node);
+    generation_.store(generation);
+    prev->next = retired_;
+    retired_ = prev;
+    reclaim();
+}
+
+/**
+ * release replaced nodes not protected by readers, keeping one to be
+ * reused by next store. Each reader protects at most one node, so
+ * number of retired nodes is limited by the number of readers
+ */
+void Cache::reclaim()
+{
+    Node *protected_nodes = nullptr;
+    while (retired_) {
+        auto node = retired_;
+        retired_ = node->next;
+        if (isHazard(node)) {
+            node->next = protected_nodes;
+            protected_nodes = node;
+        } else if (spare_) {
+            delete node;
+        } else {
+            node->value = QVariant();
+            node->next = nullptr;
+            spare_ = node;
+        }
+    }
+    retired_ = protected_nodes;
+}
+
+QVariant Cache::load() const
+{
+    quint64 generation;
+    return load(generation);
+}
+
+/// load value together with its generation
+QVariant Cache::load(quint64 &generation) const
+{
+    // node is protected only if it is still current after hazard
+    // pointer is published
+    auto &hazard = hazardSlot();
+    auto node = current_.load();
+    while (true) {
+        hazard.ptr.store(node);
+        auto current = current_.load();
+        if (current == node)
+            break;
+        node = current;
+    }
+    auto res = node->value;
+    generation = node->generation;
+    hazard.ptr.store(nullptr, std::memory_order_release);
+    return res;
+}
+
+/// arm completion before posting request, called by owner only
+void Completion::reset()
+{
+    state_.store(Pending, std::memory_order_relaxed);
+}
+
+void Completion::complete()
+{
+    if (state_.exchange(Done, std::memory_order_acq_rel) != Waiting)
+        return;
+    // owner is blocked in wait(), waiter_ is set before state_ is
+    // changed to Waiting
+    std::lock_guard<std::mutex> lock(waiter_->mutex);
+    waiter_->cond.notify_all();
+}
+
+/**
+ * wait for completion, allocates waiter on the first blocking call
+ *
+ * @return false on timeout
+ */
+bool Completion::wait(std::chrono::milliseconds timeout)
+{
+    if (isDone())
+        return true;
+
+    if (!waiter_)
+        waiter_.reset(new Waiter());
+
+    int expected = Pending;
+    if (!state_.compare_exchange_strong(expected, Waiting
+                                        , std::memory_order_acq_rel)
+        && expected == Done)
+        return true;
+
+    std::unique_lock<std::mutex> lock(waiter_->mutex);
+    return waiter_->cond.wait_for(lock, timeout, [this]() {
+            return isDone();
+        });
+}
+
+Poller::Poller()
+    : fd_(::epoll_create1(EPOLL_CLOEXEC))
+{
+    if (fd_ < 0) {
+        debug::warning("Can't create epoll instance:", ::strerror(errno));
+        return;
+    }
+    notifier_.reset(new QSocketNotifier(fd_, QSocketNotifier::Read));
+    connect(notifier_.data(), &QSocketNotifier::activated
+            , this, &Poller::drain);
+}
+
+Poller::~Poller()
 {
-    auto isOk = false;
-    auto emit_on_exit = cor::on_scope_exit([req, isOk]() {
-            emit req->updated(isOk);
-        });
-    // implementation is quick and dirty: one redundant try to access
-    // session(user) file
-    FileWriter dst(req->key_);
-    if (dst.tryOpen()) {
-        auto s = statefs::qt::valueEncode(req->value_);
-        auto data = s.toUtf8();
-        isOk = dst.write(s.toUtf8());
-    } else {
-        debug::warning("Can't access", req->key_);
+    notifier_.reset();
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+/**
+ * register property descriptor in epoll set
+ *
+ * @return false if descriptor can't be polled by epoll (e.g. it is a
+ * regular file), caller should use own notifier in this case
+ */
+bool Poller::add(int fd, Property *property)
+{
+    if (fd_ < 0 || fd < 0)
+        return false;
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = property;
+    if (::epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        debug::debug("Can't epoll", property->file_.key(), ::strerror(errno));
+        return false;
     }
+    return true;
 }
 
-void Property::changed() const
+void Poller::remove(int fd)
 {
-    debug::debug("Notify", file_.key(), targets_.size(), "targets");
-    for (auto target : targets_)
-        target->dataReady(target);
+    if (::epoll_ctl(fd_, EPOLL_CTL_DEL, fd, nullptr) < 0)
+        debug::warning("Can't remove fd from epoll set", ::strerror(errno));
 }
 
-bool Property::add(target_handle const &target)
+/**
+ * only one batch is processed per activation: epoll is level
+ * triggered, so notifier is activated again on the next event loop
+ * iteration if there are more ready descriptors and other events
+ * are not starving
+ */
+void Poller::drain()
 {
-    auto res = false;
-    auto it = targets_.find(target);
-    if (it == targets_.end()) {
-        targets_.insert(target);
-        target->attachCache(cache_);
-        res = true;
-    }
+    static const int max_batch = 64;
+    epoll_event events[max_batch];
+    Property *ready[max_batch];
+
+    auto count = ::epoll_wait(fd_, events, max_batch, 0);
+    if (count < 0 && errno != EINTR)
+        debug::warning("epoll_wait failed:", ::strerror(errno));
+
+    // properties are not removed while batch is processed, only
+    // re-registered by resubscribe()
+    for (int i = 0; i < count; ++i)
+        ready[i] = static_cast<Property*>(events[i].data.ptr);
+    if (count > 0)
+        reader_.update(ready, count);
+}
+
+namespace {
+
+const int min_read_size = 32;
+// 1MB?
+const int max_statefs_file_size = 1024 * 1024;
+
+inline qint64 nextPowerOfTwo(qint64 v)
+{
+    qint64 res = 1;
+    while (res < v)
+        res <<= 1;
     return res;
 }
 
-Property::Removed Property::remove(target_handle const &target)
+/// FNV-1a, used to detect unchanged data
+quint64 rawHash(char const *data, size_t len)
 {
-    auto res = Removed::No;
-    auto it = targets_.find(target);
-    if (it != targets_.end()) {
-        targets_.erase(it);
-        res = (targets_.size() ? Removed::Yes : Removed::Last);
+    quint64 res = 14695981039346656037ULL;
+    for (auto p = data, end = data + len; p != end; ++p) {
+        res ^= static_cast<unsigned char>(*p);
+        res *= 1099511628211ULL;
     }
     return res;
 }
 
-void PropertyMonitor::subscribe(SubscribeRequest *req)
+}
+
+std::atomic<size_t> ReadArena::limit_(0);
+
+ReadArena::ReadArena()
+    : size_(0), used_(0), required_(0), depth_(0)
 {
-    auto tgt = req->tgt_;
-    auto key = req->key_;
-    std::shared_ptr<Property> handler;
-    QVariant retval;
+}
 
-    debug::debug("Subcribe request:", tgt, key);
-    if (!tgt) {
-        debug::warning("Logic issue: subscription target is null");
-        return;
-    }
+ReadArena &ReadArena::instance()
+{
+    static thread_local ReadArena self;
+    return self;
+}
 
-    if (key.isEmpty()) {
-        debug::warning("Empty contextkit key");
-        return;
+void ReadArena::setLimit(size_t limit)
+{
+    limit_ = limit;
+}
+
+ReadBuffer ReadArena::allocate(qint64 size)
+{
+    required_ += size;
+    if (used_ + size <= size_) {
+        auto res = ReadBuffer{block_.get() + used_, size};
+        used_ += size;
+        return res;
     }
+    overflow_.emplace_back(new char[size]);
+    return ReadBuffer{overflow_.back().get(), size};
+}
+
+/**
+ * get bigger buffer, data is copied from the old one
+ *
+ * @param buf buffer allocated by this arena
+ * @param used number of bytes to be copied
+ * @param size new size
+ */
+ReadBuffer ReadArena::grow(ReadBuffer const &buf, qint64 used, qint64 size)
+{
+    // the last block in the arena can be just extended
+    if (buf.data + buf.size == block_.get() + used_
+        && used_ - buf.size + size <= size_) {
+        used_ += size - buf.size;
+        required_ += size - buf.size;
+        return ReadBuffer{buf.data, size};
+    }
+    auto res = allocate(size);
+    ::memcpy(res.data, buf.data, used);
+    required_ -= buf.size;
+    return res;
+}
 
-    auto it = properties_.find(key);
-    if (it == properties_.end()) {
-        handler = add(key);
-    } else {
-        handler = it.value();
+void ReadArena::reset()
+{
+    size_t limit = limit_;
+    auto size = (limit && required_ > limit) ? limit : required_;
+    if (size > size_ || (limit && size_ > limit)) {
+        block_.reset(size ? new char[size] : nullptr);
+        size_ = size;
     }
-    handler->add(tgt);
+    overflow_.clear();
+    used_ = required_ = 0;
+}
 
-    req->result = handler->subscribe();
+/**
+ * give up memory still used by somebody else (kernel can write into
+ * buffers of not completed io_uring requests), it is leaked instead
+ * of being reused
+ */
+void ReadArena::abandon()
+{
+    block_.release();
+    size_ = 0;
+    for (auto &p : overflow_)
+        p.release();
+    overflow_.clear();
+    used_ = required_ = 0;
 }
 
-void PropertyMonitor::unsubscribe(UnsubscribeRequest *req)
+/**
+ * set limit for the memory kept by each monitor thread to read
+ * property data. Bigger values are still read using temporary
+ * buffers. 0 (default) means no limit
+ */
+void setReadBufferLimit(size_t limit)
 {
-    auto tgt = req->tgt_;
-    auto key = req->key_;
+    ReadArena::setLimit(limit);
+}
 
-    debug::debug("Unsubcribe request:", tgt, key);
+BatchReader::BatchReader()
+    : uring_(64)
+{
+    queued_.reserve(uring_.capacity());
+}
 
-    auto phandlers = properties_.find(key);
-    if (phandlers == properties_.end())
+void BatchReader::update(Property * const *properties, size_t count)
+{
+    if (!uring_.isValid()) {
+        for (size_t i = 0; i < count; ++i)
+            properties[i]->handleActivated(-1);
         return;
+    }
 
-    auto handler = phandlers.value();
+    auto on_complete = [this](uint64_t tag, int res) {
+        complete(tag, res);
+    };
+    auto &arena = ReadArena::instance();
+    size_t pos = 0;
+    while (pos < count && uring_.isValid()) {
+        // buffers are used until all requests are completed
+        ReadArena::Scope scope(arena);
+        queued_.clear();
+        for (; pos < count && queued_.size() < uring_.capacity(); ++pos) {
+            auto p = properties[pos];
+            if (p->is_blob_) {
+                // blobs are streamed by chunks
+                p->handleActivated(-1);
+                continue;
+            }
+            if (!p->beginUpdate())
+                continue;
+            auto buf = arena.allocate(p->read_size_);
+            if (!uring_.read(p->file_.handle(), buf.data, buf.size - 1
+                             , 0, queued_.size())) {
+                // should not happen: queue is drained on each iteration
+                p->handleActivated(-1);
+                continue;
+            }
+            queued_.push_back(Request{p, buf});
+        }
 
-    if (handler->remove(tgt) == Property::Removed::Last) {
-        // last subscriber is gone
-        properties_.erase(phandlers);
+        size_t done = 0;
+        while (done < queued_.size()) {
+            auto rc = uring_.submit(queued_.size() - done);
+            if (rc < 0) {
+                debug::warning("io_uring submission failed:"
+                               , ::strerror(-rc));
+                fallback();
+                break;
+            }
+            done += uring_.complete(on_complete);
+        }
+    }
+    // if io_uring failed, the rest is read synchronously
+    for (; pos < count; ++pos)
+        properties[pos]->handleActivated(-1);
+}
+
+void BatchReader::complete(uint64_t tag, int res)
+{
+    auto &request = queued_[tag];
+    auto p = request.property;
+    auto &buf = request.buffer;
+    request.property = nullptr;
+
+    // negative result: e.g. IORING_OP_READ is not supported by kernel,
+    // just repeat ordinary read to get the same error handling
+    auto rc = (res < 0 ? p->readFrom(buf, 0)
+               : (res < buf.size - 1 ? res : p->readFrom(buf, res)));
+    if (p->endUpdate(buf, rc))
+        p->changed();
+}
+
+/**
+ * switch to synchronous reading for not completed requests. Kernel
+ * can write into buffers of submitted requests until they are
+ * completed, so all of them are reaped before the ring is closed and
+ * arena memory is reused. Requests queued but not submitted are
+ * just dropped with the ring
+ */
+void BatchReader::fallback()
+{
+    auto on_complete = [this](uint64_t tag, int res) { complete(tag, res); };
+    uring_.complete(on_complete);
+    while (uring_.inFlight()) {
+        auto rc = uring_.wait(uring_.inFlight());
+        if (rc < 0) {
+            debug::warning("Can't wait for io_uring completions:"
+                           , ::strerror(-rc));
+            // buffers are still used by kernel
+            ReadArena::instance().abandon();
+            break;
+        }
+        uring_.complete(on_complete);
+    }
+    uring_.close();
+    for (auto const &request : queued_) {
+        if (request.property)
+            request.property->handleActivated(-1);
     }
 }
 
-void PropertyMonitor::refresh(RefreshRequest *req)
+DirWatcher::DirWatcher()
+    : fd_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
 {
-    auto key = req->key_;
-    auto phandlers = properties_.find(key);
-    if (phandlers == properties_.end())
+    if (fd_ < 0) {
+        debug::warning("Can't create inotify instance:", ::strerror(errno));
         return;
+    }
+    notifier_.reset(new QSocketNotifier(fd_, QSocketNotifier::Read));
+    connect(notifier_.data(), &QSocketNotifier::activated
+            , this, &DirWatcher::onEvents);
+}
 
-    auto handler = phandlers.value();
-    handler->update();
+DirWatcher::~DirWatcher()
+{
+    notifier_.reset();
+    if (fd_ >= 0)
+        ::close(fd_);
 }
 
-std::shared_ptr<Property> PropertyMonitor::add(const QString &key)
+/**
+ * start waiting for the property file to appear in any statefs root
+ *
+ * @return false if directories can't be watched, caller should poll
+ */
+bool DirWatcher::wait(Property *p)
 {
-    auto it = properties_.insert
-        (key, make_qobject_shared<Property>(key, this));
-    return it.value();
+    if (fd_ < 0)
+        return false;
+
+    cancel(p);
+    auto const &key = p->file_.propertyKey();
+    auto ns = QFile::encodeName(key.ns());
+    auto name = QFile::encodeName(key.name());
+    bool res = false;
+    for (auto const &root : {getNamespacesRoot(), getSystemNamespacesRoot()}) {
+        auto path = QFile::encodeName(root) + '/' + ns;
+        if (watch(path, name, p) >= 0)
+            res = true;
+    }
+    if (!res)
+        cancel(p);
+    return res;
 }
 
-void Cache::store(QVariant v)
+/**
+ * watch directory for the child entry creation. If directory does not
+ * exist, the nearest existing parent is watched for the creation of
+ * the next path component
+ *
+ * @return watch descriptor or -1
+ */
+int DirWatcher::watch(QByteArray dir, QByteArray child, Property *p)
+{
+    static const uint32_t mask = IN_CREATE | IN_MOVED_TO | IN_ATTRIB
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+    while (!dir.isEmpty()) {
+        auto wd = ::inotify_add_watch(fd_, dir.constData(), mask);
+        if (wd >= 0) {
+            waiters_[wd].push_back(Waiter{p, child});
+            watches_[p].push_back(wd);
+            return wd;
+        }
+        if ((errno != ENOENT && errno != ENOTDIR) || dir == "/")
+            break;
+        auto pos = dir.lastIndexOf('/');
+        if (pos < 0)
+            break;
+        child = dir.mid(pos + 1);
+        dir.truncate(pos ? pos : 1);
+    }
+    debug::debug("Can't watch", dir, "for", p->file_.key()
+                 , ::strerror(errno));
+    return -1;
+}
+
+void DirWatcher::cancel(Property *p)
 {
-    QMutexLocker lock(&mutex_);
-    data_ = v;
+    auto it = watches_.find(p);
+    if (it == watches_.end())
+        return;
+
+    for (auto wd : it.value()) {
+        auto w = waiters_.find(wd);
+        if (w == waiters_.end())
+            continue;
+        auto &waiters = w.value();
+        for (auto i = waiters.begin(); i != waiters.end();) {
+            if (i->property == p)
+                i = waiters.erase(i);
+            else
+                ++i;
+        }
+        if (waiters.isEmpty()) {
+            ::inotify_rm_watch(fd_, wd);
+            waiters_.erase(w);
+        }
+    }
+    watches_.erase(it);
 }
 
-QVariant Cache::load() const
+void DirWatcher::onEvents()
 {
-    QMutexLocker lock(&mutex_);
-    return data_;
+    static const uint32_t child_events = IN_CREATE | IN_MOVED_TO | IN_ATTRIB;
+    alignas(inotify_event) char buf[4096];
+    QSet<Property*> ready;
+
+    while (true) {
+        auto len = ::read(fd_, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (auto pos = buf; pos < buf + len;) {
+            auto ev = reinterpret_cast<inotify_event const*>(pos);
+            pos += sizeof(inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (auto p : watches_.keys())
+                    ready.insert(p);
+                continue;
+            }
+            auto w = waiters_.find(ev->wd);
+            if (w == waiters_.end())
+                continue;
+            // directory itself is changed or removed: waiters should
+            // check path again
+            auto is_self = !(ev->mask & child_events) || !ev->len;
+            for (auto const &waiter : w.value()) {
+                if (is_self || waiter.child == ev->name)
+                    ready.insert(waiter.property);
+            }
+            if (ev->mask & IN_IGNORED)
+                waiters_.erase(w);
+        }
+    }
+
+    for (auto p : ready) {
+        if (!watches_.contains(p))
+            continue;
+        cancel(p);
+        p->is_waiting_ = false;
+        p->trySubscribe();
+    }
 }
 
-Property::Property(const QString &key, QObject *parent)
+Property::Property(PropertyKey const &key, QObject *parent
+                   , Poller *poller, DirWatcher *watcher)
     : QObject(parent)
     , file_(key)
+    , poller_(poller)
+    , polled_fd_(-1)
+    , watcher_(watcher)
+    , is_waiting_(false)
+    , type_(statefs::qt::getPropertyType(key))
+    , is_blob_(type_ == blobType())
+    , read_size_(min_read_size)
+    , prev_raw_size_(0)
+    , prev_raw_hash_(0)
     , reopen_interval_(100)
     , reopen_timer_(new QTimer(this))
     , is_subscribed_(false)
+    , is_raw_valid_(false)
     , cache_(std::make_shared<Cache>())
+    , targets_count_(0)
+    , throttle_timer_(new QTimer(this))
 {
+    clock_.start();
     reopen_timer_->setSingleShot(true);
     connect(reopen_timer_, SIGNAL(timeout()), this, SLOT(trySubscribe()));
+    throttle_timer_->setSingleShot(true);
+    connect(throttle_timer_, SIGNAL(timeout()), this, SLOT(flushThrottled()));
 }
 
 Property::~Property()
 {
+    stats_.targets -= targets_count_;
+    if (is_waiting_)
+        watcher_->cancel(this);
     unsubscribe();
 }
 
@@ -602,12 +2149,15 @@ void Property::trySubscribe()
     static const int max_interval_ = 1000 * 60 * 3;
     static const int fast_interval_ = 1000 * 3;
     static const int slow_interval_ = 1000 * 30;
-    if (file_.tryOpen()) {
+    if (file_.tryOpen() || isCreatedWhileWatching()) {
         reopen_interval_ = 500;
         subscribe_();
         return;
     }
+    if (is_waiting_)
+        return;
 
+    // inotify is not available, fall back to polling
     if (reopen_interval_ < fast_interval_) {
         reopen_interval_ *= 2;
     } else if (reopen_interval_ < slow_interval_) {
@@ -620,6 +2170,41 @@ void Property::trySubscribe()
     reopen_timer_->start(reopen_interval_);
 }
 
+/**
+ * property file is missing: wait until it is created or, if
+ * directories can't be watched, retry later
+ *
+ * @return true if file is created meanwhile and it is opened
+ */
+bool Property::waitForFile()
+{
+    if (isCreatedWhileWatching())
+        return true;
+    if (!is_waiting_)
+        reopen_timer_->start(reopen_interval_);
+    return false;
+}
+
+/**
+ * start waiting for the file creation using inotify. File can be
+ * created after the failed open but before the watch is added, so it
+ * is opened again after that
+ *
+ * @return true if file is opened, is_waiting_ is set if inotify is
+ * waiting for the file
+ */
+bool Property::isCreatedWhileWatching()
+{
+    if (!watcher_ || !watcher_->wait(this))
+        return false;
+    if (file_.tryOpen()) {
+        watcher_->cancel(this);
+        return true;
+    }
+    is_waiting_ = true;
+    return false;
+}
+
 void Property::resubscribe()
 {
     if (is_subscribed_) {
@@ -630,61 +2215,174 @@ void Property::resubscribe()
 
 bool Property::update()
 {
-    // 1MB?
-    static const size_t max_statefs_file_size = 1024 * 1024;
+    if (!beginUpdate())
+        return false;
+
+    auto &arena = ReadArena::instance();
+    ReadArena::Scope scope(arena);
+    if (is_blob_)
+        return updateBlob();
+
+    auto buf = arena.allocate(read_size_);
+    return endUpdate(buf, readFrom(buf, 0));
+}
+
+/**
+ * streaming read of the blob property: data is read in fixed size
+ * chunks, chunks are kept in the value as is, without copying and
+ * decoding
+ *
+ * @return true if value is changed
+ */
+bool Property::updateBlob()
+{
+    static const int chunk_size = 64 * 1024;
+
+    Blob blob;
+    qint64 offset = 0;
+    auto to_read = std::min(read_size_, chunk_size);
+    while (true) {
+        QByteArray chunk(to_read, Qt::Uninitialized);
+        auto len = file_.read(chunk.data(), to_read, offset);
+        if (len < 0)
+            return endUpdate(ReadBuffer{nullptr, 0}, len);
+        offset += len;
+        if (len < to_read) {
+            chunk.resize(len);
+            chunk.squeeze();
+            blob.append(chunk);
+            break;
+        }
+        blob.append(chunk);
+        if (offset >= max_statefs_file_size) {
+            debug::warning("File size for " + file_.fileName() +
+                           "reached max ", max_statefs_file_size);
+            break;
+        }
+        to_read = chunk_size;
+    }
+    read_size_ = std::max<int>(min_read_size, nextPowerOfTwo(offset + 2));
 
-    static const size_t cap = 31;
-    bool is_updated = false;
+    auto prev_value = cache_->load();
+    if (prev_value.userType() == blobType()
+        && prev_value.value<Blob>() == blob) {
+        ++stats_.unchanged;
+        return false;
+    }
+    cache_->store(QVariant::fromValue(blob));
+    debug::debug("Updated", file_.key(), "blob size", blob.size());
+    return true;
+}
 
+/**
+ * prepare property for reading data
+ *
+ * @return false if property file can't be opened
+ */
+bool Property::beginUpdate()
+{
+    ++stats_.updates;
     if (!file_.tryOpen()) {
         debug::warning("Can't open ", file_.fileName());
+        is_raw_valid_ = false;
         cache_->store(statefs::qt::valueDefault(cache_->load()));
         resubscribe();
-        return is_updated;
+        return false;
     }
 
+#ifdef STATEFS_QT_TOUCH_WORKAROUND
     // WORKAROUND: file is just opened and closed before reading from
     // real source to make vfs (?) reread file data to cache
-    QFile touchFile(file_.fileName());
-    touchFile.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
-
-    file_.seek(0);
-    auto size = file_.size();
-    // statefs file size can change, so need to read more and check:
-    // if amount of data read > size, continue to read. Also readAll()
-    // is not suitable for the same reason
-    auto to_read = size + cap;
-    if (buffer_.size() < to_read + 1)
-        buffer_.resize(to_read + 1 /* for \0 */);
-
-    auto rc = file_.read(buffer_, to_read);
-    // read all data
-    if (rc > size) {
-        int bytes_read = 0;
-        while (rc > 0) {
-            bytes_read += rc;
-            if ((size_t)bytes_read > max_statefs_file_size) {
-                debug::warning("File size for " + file_.fileName() +
-                               "reached max ", max_statefs_file_size);
+    file_.touch();
+#endif
+    return true;
+}
+
+/**
+ * read the rest of property data, starting from offset (bytes
+ * already read into buf). Buffer is replaced by the bigger one from
+ * the arena if data does not fit
+ *
+ * @return total size of data read or negative value on error
+ */
+qint64 Property::readFrom(ReadBuffer &buf, qint64 rc)
+{
+    // statefs file size can change, so size is not queried: data is
+    // read with pread() (no seek is needed) while buffer is filled
+    // completely. Buffer is kept between updates, so usually one
+    // call is enough
+    while (true) {
+        auto to_read = buf.size - 1 /* for \0 */ - rc;
+        if (to_read > 0) {
+            auto len = file_.read(buf.data + rc, to_read, rc);
+            if (len < 0)
+                return len;
+            rc += len;
+            if (len < to_read)
                 break;
-            }
-            // maybe there is more data to read
-            buffer_.resize(buffer_.size() + bytes_read + 1);
-            rc = file_.read(buffer_, bytes_read, bytes_read);
         }
-        rc = bytes_read;
+        if (buf.size >= max_statefs_file_size) {
+            debug::warning("File size for " + file_.fileName() +
+                           "reached max ", max_statefs_file_size);
+            break;
+        }
+        buf = ReadArena::instance().grow
+            (buf, rc, std::min<qint64>(buf.size * 2, max_statefs_file_size));
     }
-    touchFile.close();
+    return rc;
+}
+
+/**
+ * decode data read into buf
+ *
+ * @return true if value is changed
+ */
+bool Property::endUpdate(ReadBuffer const &buf, qint64 rc)
+{
+    bool is_updated = false;
     QVariant value, prev_value;
     if (rc >= 0) {
-        buffer_[(int)rc] = '\0';
-        auto s = QString(buffer_);
+        buf.data[rc] = '\0';
+        // next read block is big enough to read the same data with
+        // one call
+        read_size_ = std::max<int>
+            (min_read_size, std::min<qint64>(nextPowerOfTwo(rc + 2)
+                                             , max_statefs_file_size));
+        // data is decoded directly from the buffer, without
+        // intermediate QString
+        auto data = buf.data;
+        auto len = qstrnlen(data, rc);
+        // statefs wakes up subscribers also if data is not changed,
+        // there is no need to decode the same data again. Hash is
+        // used to reject changed longer values without comparing
+        auto is_long = (len > max_raw_size);
+        auto hash = (is_long ? rawHash(data, len) : 0);
+        if (is_raw_valid_ && len == (uint)prev_raw_size_
+            && (is_long
+                ? (hash == prev_raw_hash_
+                   && !::memcmp(data, prev_long_raw_.constData(), len))
+                : !::memcmp(data, prev_raw_, len))) {
+            ++stats_.unchanged;
+            return is_updated;
+        }
+        is_raw_valid_ = true;
+        prev_raw_size_ = len;
+        if (is_long) {
+            prev_raw_hash_ = hash;
+            // buffer is reused, so there is no allocation if size of
+            // the value is not increased
+            prev_long_raw_.resize(len);
+            ::memcpy(prev_long_raw_.data(), data, len);
+        } else {
+            ::memcpy(prev_raw_, data, len);
+        }
+
         prev_value = cache_->load();
-        if (s.size()) {
-            value = statefs::qt::valueDecode(s);
+        if (len) {
+            value = statefs::qt::valueDecodeRaw(data, len, type_);
         } else {
             if (prev_value.isNull()) {
-                value = s;
+                value = statefs::qt::valueDecode(QString(""), type_);
             } else {
                 value = statefs::qt::valueDefault(prev_value);
             }
@@ -696,6 +2394,7 @@ bool Property::update()
         }
     } else {
         debug::warning("Error accessing? ", rc, "..." + file_.fileName());
+        is_raw_valid_ = false;
         resubscribe();
     }
     return is_updated;
@@ -710,45 +2409,78 @@ void Property::handleActivated(int)
 
 QVariant Property::subscribe()
 {
-    return (!is_subscribed_ ? subscribe_() : cache_->load());
+    quint64 generation;
+    return subscribe(generation);
 }
 
-QVariant Property::subscribe_()
+/**
+ * @param generation output parameter: cache generation of the
+ * returned value, 0 if property is not subscribed yet
+ */
+QVariant Property::subscribe(quint64 &generation)
 {
-    if (reopen_timer_->isActive())
+    generation = 0;
+    if (!is_subscribed_ && !subscribe_())
         return QVariant();
+    return cache_->load(generation);
+}
 
-    if (!file_.tryOpen()) {
-        reopen_timer_->start(reopen_interval_);
-        return QVariant();
-    }
+bool Property::subscribe_()
+{
+    if (reopen_timer_->isActive() || is_waiting_)
+        return false;
+
+    if (!file_.tryOpen() && !waitForFile())
+        return false;
     is_subscribed_ = true;
 
-    file_.connect(this, &Property::handleActivated);
+    watch();
 
     if (update())
         changed();
 
-    return cache_->load();
+    return true;
 }
 
 void Property::unsubscribe()
 {
+    is_raw_valid_ = false;
     if (is_subscribed_) {
         is_subscribed_ = false;
+        unwatch();
         file_.close();
     }
 }
 
+void Property::watch()
+{
+    auto fd = file_.handle();
+    if (poller_ && poller_->add(fd, this)) {
+        polled_fd_ = fd;
+        return;
+    }
+    file_.connect(this, &Property::handleActivated);
+}
+
+/// should be called before descriptor is closed
+void Property::unwatch()
+{
+    if (polled_fd_ >= 0) {
+        poller_->remove(polled_fd_);
+        polled_fd_ = -1;
+    }
+}
+
 }}
 
 using statefs::qt::PropertyMonitor;
-using statefs::qt::ReplyEvent;
 
-ContextPropertyPrivate::ContextPropertyPrivate(const QString &key)
+ContextPropertyPrivate::ContextPropertyPrivate(statefs::qt::PropertyKey const &key)
     : key_(key)
     , state_(Initial)
     , is_cached_(false)
+    , generation_(0)
+    , subscribed_generation_(0)
     , handle_(this)
     , update_queued_(ATOMIC_FLAG_INIT)
 {
@@ -774,18 +2506,15 @@ bool ContextPropertyPrivate::waitForUnsubscription() const
 
     auto res = false;
     auto fn = [this, &res]() {
-        std::future_status status;
         for (auto count = 0; count != count_end; --count) {
-            // cor::wait_for for compatibility with gcc 4.6
-            status = cor::wait_for(on_unsubscribed_, min_timeout);
-            if (status != std::future_status::timeout) {
+            if (on_unsubscribed_.wait(min_timeout)) {
                 res = true;
                 return;
             } else if (!count) {
-                debug::warning("Waiting for ages unsubscribing:", key_);
+                debug::warning("Waiting for ages unsubscribing:", key_.key());
             }
         }
-        debug::warning("Timeout unsubscribing:", key_);
+        debug::warning("Timeout unsubscribing:", key_.key());
     };
     execute_nothrow(fn, __PRETTY_FUNCTION__);
     return res;
@@ -793,7 +2522,7 @@ bool ContextPropertyPrivate::waitForUnsubscription() const
 
 QString ContextPropertyPrivate::key() const
 {
-    return key_;
+    return key_.key();
 }
 
 QVariant ContextPropertyPrivate::value(const QVariant &defVal) const
@@ -806,33 +2535,25 @@ QVariant ContextPropertyPrivate::value() const
     return value(QVariant());
 }
 
-PropertyMonitor::monitor_ptr ContextPropertyPrivate::actor()
-{
-    return PropertyMonitor::instance();
-}
-
-void ContextPropertyPrivate::onChanged(QVariant v) const
+/**
+ * @return true if subscriber should be notified
+ */
+bool ContextPropertyPrivate::onChanged(QVariant v) const
 {
     bool subscribing = state_ == Subscribing;
     if (subscribing)
         state_ = Subscribed;
 
     if (update(v) || subscribing) {
-        debug::debug("Notify data ready", key_, v);
-        emit valueChanged();
+        debug::debug("Notify data ready", key_.key(), v);
+        return true;
     }
+    return false;
 }
 
-void ContextPropertyPrivate::postEvent(ReplyEvent *e)
-{
-    QCoreApplication::postEvent(this, static_cast<QEvent*>(e));
-}
-
-
 bool ContextPropertyPrivate::event(QEvent *e)
 {
     using statefs::qt::Event;
-    using statefs::qt::DataReadyEvent;
     if (e->type() < QEvent::User)
         return QObject::event(e);
 
@@ -840,12 +2561,13 @@ bool ContextPropertyPrivate::event(QEvent *e)
     auto fn = [this, e, &res]() {
         auto t = static_cast<Event::Type>(e->type());
         switch (t) {
-        case Event::Ready: {
-            auto p = EVENT_CAST(e, DataReadyEvent);
-            debug::debug("Data ready:", this, key_);
-            if (p) updateFromRemoteCache(p);
+        case Event::Ready:
+            // only DataReadyEvent has this type
+            debug::debug("Data ready:", this, key_.key());
+            update_queued_.clear();
+            if (updateFromRemoteCache())
+                emit valueChanged();
             break;
-        }
         default:
             debug::warning("Unknown user event", t);
             res = QObject::event(e);
@@ -872,31 +2594,34 @@ bool ContextPropertyPrivate::update(QVariant const &v) const
 
 const ContextPropertyInfo* ContextPropertyPrivate::info() const
 {
-    return nullptr; // TODO
+    if (!info_)
+        info_.reset(new ContextPropertyInfo(key_.key()));
+    return info_.data();
 }
 
 void ContextPropertyPrivate::subscribe() const
 {
     auto fn = [this]() {
         using statefs::qt::SubscribeRequest;
-        debug::debug("Subscribe request:", key_);
+        debug::debug("Subscribe request:", key_.key());
         if (state_ == Subscribing || state_ == Subscribed) {
-            debug::debug("Already subscribed", key_);
+            debug::debug("Already subscribed", key_.key());
             return;
         }
         // unsubscription is asynchronous, so wait for it to be finished
         // if resubcribing
         if (state_ == Unsubscribing) {
-            debug::debug("Waiting for being unsubcribed", key_);
+            debug::debug("Waiting for being unsubcribed", key_.key());
             if (!waitForUnsubscription())
-                debug::warning("Resubscribing while not unsubscribed yet:", key_);
+                debug::warning("Resubscribing while not unsubscribed yet:", key_.key());
         }
 
         state_ = Subscribing;
-        std::promise<QVariant> res;
-        on_subscribed_ = res.get_future();
-        auto ev = new SubscribeRequest(this->handle_, key_, std::move(res));
-        actor()->postEvent(ev);
+        on_subscribed_.reset();
+        auto cmd = new SubscribeRequest
+            (this->handle_, key_, statefs::qt::ChangeDispatcher::instance()
+             , rate_limit_);
+        PropertyMonitor::post(key_, cmd);
     };
     execute_nothrow(fn, __PRETTY_FUNCTION__);
 }
@@ -907,11 +2632,14 @@ void ContextPropertyPrivate::unsubscribe() const
         using statefs::qt::UnsubscribeRequest;
         if (state_ == Unsubscribing)
             return;
+        // called from the destructor after detach(): monitor does not
+        // hold the handle, so there is nothing to unsubscribe
+        if (!handle_)
+            return;
 
-        std::promise<void> res;
-        on_unsubscribed_ = res.get_future();
-        auto ev = new UnsubscribeRequest(this->handle_, key_, std::move(res));
-        actor()->postEvent(ev);
+        on_unsubscribed_.reset();
+        auto cmd = new UnsubscribeRequest(this->handle_, key_.key());
+        PropertyMonitor::post(key_, cmd);
         state_ = Unsubscribing;
     };
     execute_nothrow(fn, __PRETTY_FUNCTION__);
@@ -927,19 +2655,19 @@ void ContextPropertyPrivate::waitForSubscription() const
         if (state_ != Subscribing)
             return;
 
-        std::future_status status;
         for (auto count = 0; count != count_end; --count) {
-            // cor::wait_for for compatibility with gcc 4.6
-            status = cor::wait_for(on_subscribed_, min_timeout);
-            if (status != std::future_status::timeout) {
-                update(on_subscribed_.get());
+            if (on_subscribed_.wait(min_timeout)) {
+                // value is consumed, the same generation is not
+                // loaded again from the remote cache
+                update(subscribed_value_);
+                generation_ = subscribed_generation_;
                 state_ = Subscribed;
                 return;
             } else if (!count) {
-                debug::warning("Waiting for ages subscribing:", key_);
+                debug::warning("Waiting for ages subscribing:", key_.key());
             }
         }
-        debug::warning("Timeout subscribing:", key_);
+        debug::warning("Timeout subscribing:", key_.key());
     };
     execute_nothrow(fn, __PRETTY_FUNCTION__);
 }
@@ -972,7 +2700,21 @@ void ContextPropertyPrivate::setTypeCheck(bool)
 void ContextPropertyPrivate::refresh() const
 {
     using statefs::qt::RefreshRequest;
-    actor()->postEvent(new RefreshRequest(this->handle_, key_));
+    PropertyMonitor::post(key_, new RefreshRequest(this->handle_, key_.key()));
+}
+
+/**
+ * limit rate of notifications, applied immediately if subscribed or
+ * on the next subscription
+ */
+void ContextPropertyPrivate::setRateLimit(statefs::qt::RateLimit const &limit) const
+{
+    using statefs::qt::ThrottleRequest;
+    if (limit == rate_limit_)
+        return;
+    rate_limit_ = limit;
+    if (state_ == Subscribing || state_ == Subscribed)
+        PropertyMonitor::post(key_, new ThrottleRequest(this->handle_, key_.key(), limit));
 }
 
 void ContextPropertyPrivate::attachCache(std::shared_ptr<statefs::qt::Cache> cache) const
@@ -981,26 +2723,43 @@ void ContextPropertyPrivate::attachCache(std::shared_ptr<statefs::qt::Cache> cac
     remote_cache_ = cache;
 }
 
-void ContextPropertyPrivate::dataReady(statefs::qt::target_handle self_handle)
+void ContextPropertyPrivate::dataReady()
 {
-    // called from other thread
-    if (!update_queued_.test_and_set(std::memory_order_acquire)) {
-        postEvent(new statefs::qt::DataReadyEvent(self_handle));
+    // called from other thread, event memory is reused from the
+    // pool. seq_cst: if event is not posted because previous one is
+    // not handled yet, new cache generation is seen by the handler
+    if (!update_queued_.test_and_set()) {
+        QCoreApplication::postEvent(this, new statefs::qt::DataReadyEvent());
     }
 }
 
-void ContextPropertyPrivate::updateFromRemoteCache(statefs::qt::DataReadyEvent *)
+/**
+ * @return true if subscriber should be notified
+ */
+bool ContextPropertyPrivate::updateFromRemoteCache()
 {
     // called from the object thread
-    update_queued_.clear(std::memory_order_release);
     // cache is attached from an other thread, so save pointer copy
     auto pcache = remote_cache_.lock();
-    if (pcache)
-        onChanged(pcache->load());
+    if (!pcache)
+        return false;
+    // value is already consumed, subscribing state should be
+    // finished anyway
+    if (state_ != Subscribing && pcache->generation() == generation_)
+        return false;
+    return onChanged(pcache->load(generation_));
 }
 
 
 ContextProperty::ContextProperty(const QString &key, QObject *parent)
+    : QObject(parent)
+    , priv(new ContextPropertyPrivate(statefs::qt::PropertyKey(key)))
+{
+    connect(priv, SIGNAL(valueChanged()), this, SIGNAL(valueChanged()));
+    priv->subscribe();
+}
+
+ContextProperty::ContextProperty(statefs::qt::Key const &key, QObject *parent)
     : QObject(parent)
     , priv(new ContextPropertyPrivate(key))
 {
@@ -1029,6 +2788,11 @@ QVariant ContextProperty::value() const
     return priv->value();
 }
 
+quint64 ContextProperty::generation() const
+{
+    return priv->generation();
+}
+
 const ContextPropertyInfo* ContextProperty::info() const
 {
     return priv->info();
@@ -1054,6 +2818,68 @@ void ContextProperty::waitForSubscription(bool block) const
     return priv->waitForSubscription(block);
 }
 
+void ContextProperty::setRateLimit(int interval, int debounce)
+{
+    priv->setRateLimit(statefs::qt::RateLimit(interval, debounce));
+}
+
+/**
+ * @class ContextPropertyInfo
+ *
+ * @brief Property metadata: information about declared property
+ * type. If type is declared, property value is converted to this
+ * type instead of detecting it using heuristics, so e.g. string
+ * property with value "0123" is not converted to integer.
+ */
+ContextPropertyInfo::ContextPropertyInfo(const QString &key, QObject *parent)
+    : QObject(parent)
+    , key_(key)
+    , type_(statefs::qt::getPropertyType(key))
+{
+}
+
+ContextPropertyInfo::~ContextPropertyInfo()
+{
+}
+
+QString ContextPropertyInfo::key() const
+{
+    return key_;
+}
+
+/**
+ * @return declared type name or empty string if type is not declared
+ */
+QString ContextPropertyInfo::type() const
+{
+    return declared() ? QMetaType::typeName(type_) : QString();
+}
+
+/**
+ * @return declared type, QVariant::UserType for user types like
+ * statefs::qt::blobType()
+ */
+QVariant::Type ContextPropertyInfo::variantType() const
+{
+    return (type_ < QMetaType::User
+            ? static_cast<QVariant::Type>(type_)
+            : QVariant::UserType);
+}
+
+bool ContextPropertyInfo::declared() const
+{
+    return type_ != QVariant::Invalid;
+}
+
+/**
+ * declare property type, should be called before property is
+ * subscribed by any client in the process
+ */
+void ContextPropertyInfo::declare(const QString &key, QVariant::Type type)
+{
+    statefs::qt::setPropertyType(key, type);
+}
+
 void ContextProperty::ignoreCommander()
 {
 }
@@ -1066,6 +2892,16 @@ namespace statefs { namespace qt {
 
 DiscreteProperty::DiscreteProperty
 (QString const &key, QObject *parent)
+    : QObject(parent)
+    , impl_(new DiscretePropertyImpl(PropertyKey(key), this))
+{
+    connect(impl_, &DiscretePropertyImpl::changed
+            , this, &DiscreteProperty::changed
+            , Qt::DirectConnection);
+}
+
+DiscreteProperty::DiscreteProperty
+(Key const &key, QObject *parent)
     : QObject(parent)
     , impl_(new DiscretePropertyImpl(key, this))
 {
@@ -1084,7 +2920,7 @@ void DiscreteProperty::refresh() const
 }
 
 DiscretePropertyImpl::DiscretePropertyImpl
-(QString const &key, QObject *parent)
+(PropertyKey const &key, QObject *parent)
     : QObject(parent)
     , ContextPropertyPrivateHandle(key)
 {
@@ -1112,6 +2948,16 @@ void DiscretePropertyImpl::refresh() const
 
 PropertyWriter::PropertyWriter
 (QString const &key, QObject *parent)
+    : QObject(parent)
+    , impl_(new PropertyWriterImpl(PropertyKey(key)))
+{
+    connect(impl_, &PropertyWriterImpl::updated
+            , this, &PropertyWriter::updated
+            , Qt::DirectConnection);
+}
+
+PropertyWriter::PropertyWriter
+(Key const &key, QObject *parent)
     : QObject(parent)
     , impl_(new PropertyWriterImpl(key))
 {
@@ -1127,26 +2973,78 @@ PropertyWriter::~PropertyWriter()
     impl_->detach();
 }
 
+/**
+ * set property value. Values are coalesced: while previous value is
+ * being written or during the flush interval only the last set value
+ * is kept and it is written after. updated() is emitted once for
+ * each written value.
+ */
 void PropertyWriter::set(QVariant v)
 {
     impl_->set(std::move(v));
 }
 
-PropertyWriterImpl::PropertyWriterImpl(QString const &key)
-    : key_(key)
+/**
+ * @param msec minimal interval between writes, 0 (default) means
+ * value is written immediately if there is no write in progress
+ */
+void PropertyWriter::setFlushInterval(int msec)
 {
+    impl_->setFlushInterval(msec);
+}
+
+PropertyWriterImpl::PropertyWriterImpl(PropertyKey const &key)
+    : handle_(this, &QObject::deleteLater)
+    , key_(key)
+    , has_pending_(false)
+    , is_writing_(false)
+    , flush_timer_(new QTimer(this))
+{
+    flush_timer_->setSingleShot(true);
+    flush_timer_->setInterval(0);
+    connect(flush_timer_, &QTimer::timeout, this, &PropertyWriterImpl::flush);
 }
 
 void PropertyWriterImpl::detach()
 {
+    // last value should not be lost
+    flush_timer_->stop();
+    if (has_pending_)
+        post();
     handle_.reset();
 }
 
+void PropertyWriterImpl::setFlushInterval(int msec)
+{
+    flush_timer_->setInterval(std::max(msec, 0));
+}
+
 void PropertyWriterImpl::set(QVariant &&v)
+{
+    pending_ = std::move(v);
+    has_pending_ = true;
+    if (!is_writing_ && !flush_timer_->isActive()) {
+        if (flush_timer_->interval())
+            flush_timer_->start();
+        else
+            flush();
+    }
+}
+
+void PropertyWriterImpl::flush()
+{
+    if (has_pending_ && !is_writing_)
+        post();
+}
+
+void PropertyWriterImpl::post()
 {
     using namespace statefs::qt;
-    auto monitor = PropertyMonitor::instance();
-    monitor->postEvent(new WriteRequest(handle_, key_, std::move(v)));
+    has_pending_ = false;
+    is_writing_ = true;
+    PropertyMonitor::post
+        (key_, new WriteRequest(handle_, key_, std::move(pending_)));
+    pending_ = QVariant();
 }
 
 bool PropertyWriterImpl::event(QEvent *e)
@@ -1162,8 +3060,16 @@ bool PropertyWriterImpl::event(QEvent *e)
         switch (t) {
         case Event::WriteStatus: {
             auto p = EVENT_CAST(e, WriteReply);
-            if (p)
-                emit updated(p->is_updated_);
+            if (!p)
+                break;
+            is_writing_ = false;
+            emit updated(p->is_updated_);
+            if (has_pending_ && handle_ && !flush_timer_->isActive()) {
+                if (flush_timer_->interval())
+                    flush_timer_->start();
+                else
+                    flush();
+            }
             break;
         }
         default:
@@ -2,12 +2,23 @@
 #define _STATEFS_CKIT_PROPERTY_HPP_
 
 #include "actor.hpp"
+#include "uring.hpp"
+
+#include <statefs/qt/util.hpp>
+#include <statefs/qt/client.hpp>
 
 //#include <cor/mt.hpp>
 #include <qtaround/mt.hpp>
 #include <qtaround/debug.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include <QObject>
 #include <QString>
@@ -19,8 +30,13 @@
 #include <QMutex>
 #include <QSet>
 #include <QMap>
+#include <QHash>
+#include <QList>
 #include <QSocketNotifier>
 #include <QPointer>
+#include <QElapsedTimer>
+
+#include <sys/types.h>
 
 class ContextPropertyInfo;
 class QSocketNotifier;
@@ -45,24 +61,13 @@ public:
     enum Type { User = 0, System };
 
     typedef std::unique_ptr<QFile> file_ptr;
-    typedef std::array<file_ptr, System + 1> files_type;
 
-    File(QString const &);
+    File(PropertyKey const &);
     virtual ~File() {}
 
     QString fileName() const
     {
-        return file_ ? file_->fileName() : "?";
-    }
-
-    bool seek(qint64 pos)
-    {
-        return file_ ? file_->seek(pos) : false;
-    }
-
-    qint64 size() const
-    {
-        return file_ ? file_->size() : 0;
+        return file_ ? nameFor(type_) : "?";
     }
 
     int handle() const
@@ -71,8 +76,10 @@ public:
     }
 
     virtual void close();
-    qint64 read(QByteArray &, size_t, size_t offset = 0);
-    QString key() const { return key_; }
+    void touch() const;
+    qint64 read(char *, size_t, off_t offset = 0);
+    QString key() const { return key_.key(); }
+    PropertyKey const & propertyKey() const { return key_; }
 
 protected:
     bool tryOpen(QIODevice::OpenMode);
@@ -80,19 +87,21 @@ protected:
     file_ptr file_;
 
 private:
-    files_type openNew(QIODevice::OpenMode);
+    file_ptr openNew(QIODevice::OpenMode);
     QString nameFor(Type) const;
-    QString getError(file_ptr const&) const;
+    QString getError() const;
 
     Type type_;
-    QString key_;
+    PropertyKey key_;
+    QByteArray file_name_;
     size_t failures_count_;
+    int error_;
 };
 
 class FileReader : public File
 {
 public:
-    FileReader(QString const &key) : File(key) {}
+    FileReader(PropertyKey const &key) : File(key) {}
 
     bool tryOpen()
     {
@@ -120,91 +129,566 @@ public:
 class FileWriter : public File
 {
 public:
-    FileWriter(QString const &key) : File(key) {}
+    FileWriter(PropertyKey const &key) : File(key), last_size_(0) {}
 
     bool tryOpen()
     {
         return File::tryOpen(QIODevice::WriteOnly | QIODevice::Unbuffered);
     }
-    bool write(QByteArray const &);
+    bool write(char const *, int);
+private:
+    int last_size_;
 };
 
+/**
+ * Property value written by the monitor thread and read by the
+ * subscribers from their threads. Each value is published as the
+ * separate immutable node, so readers never lock and never write
+ * shared memory: each reader thread protects the node it is copying
+ * value from with its own hazard pointer. Only one thread (the
+ * monitor) stores values, each replaced node is released by it on
+ * the next store after the last reader left the node.
+ *
+ * Each stored value gets the new generation, generations are unique
+ * in the process, so subscriber can skip loading the value it has
+ * already seen by comparing generation()
+ */
 class Cache {
 public:
-    Cache() {}
+    Cache();
+    ~Cache();
 
     void store(QVariant v);
     QVariant load() const;
+    QVariant load(quint64 &generation) const;
+    quint64 generation() const { return generation_.load(); }
+private:
+    Cache(Cache const&) = delete;
+    Cache & operator =(Cache const&) = delete;
+
+    struct Node
+    {
+        QVariant value;
+        quint64 generation;
+        Node *next;
+    };
+
+    void reclaim();
+
+    static std::atomic<quint64> last_generation_;
+
+    std::atomic<Node*> current_;
+    std::atomic<quint64> generation_;
+    // accessed only by the writer
+    Node *retired_;
+    Node *spare_;
+};
+
+/**
+ * One-shot completion signalled from the monitor thread. Unlike
+ * std::promise/std::future it does not allocate shared state: it is
+ * just an atomic state word embedded into the owner, mutex and
+ * condition variable are allocated only when owner really blocks in
+ * wait(). Owner is kept alive by the request holding target handle
+ * until complete() returns
+ */
+class Completion
+{
+public:
+    Completion() : state_(Done) {}
+
+    void reset();
+    void complete();
+    bool wait(std::chrono::milliseconds);
+    bool isDone() const { return state_.load(std::memory_order_acquire) == Done; }
+
+private:
+    Completion(Completion const&) = delete;
+    Completion & operator =(Completion const&) = delete;
+
+    enum State { Pending, Waiting, Done };
+
+    struct Waiter
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+
+    std::atomic<int> state_;
+    std::unique_ptr<Waiter> waiter_;
+};
+
+/// Counters updated from the monitor thread(s)
+struct MonitorCounters
+{
+    MonitorCounters() : updates(0), unchanged(0), targets(0) {}
+
+    std::atomic<quint64> updates;
+    std::atomic<quint64> unchanged;
+    std::atomic<quint64> targets;
+};
+
+/// Memory block allocated from ReadArena
+struct ReadBuffer
+{
+    char *data;
+    qint64 size;
+};
+
+/**
+ * Per-thread arena for the property data reads. Raw data is needed
+ * only until it is decoded, so all properties updated by the thread
+ * share the same memory. Blocks not fitting into the arena are
+ * allocated separately and released on reset(), arena is grown to
+ * fit them next time if it does not exceed the limit
+ */
+class ReadArena
+{
+public:
+    ReadArena();
+
+    static ReadArena &instance();
+    static void setLimit(size_t);
+
+    ReadBuffer allocate(qint64);
+    ReadBuffer grow(ReadBuffer const &, qint64, qint64);
+    size_t capacity() const { return size_; }
+    void abandon();
+
+    /// arena is reset when the outermost scope is left
+    class Scope
+    {
+    public:
+        Scope(ReadArena &arena) : arena_(arena) { ++arena_.depth_; }
+        ~Scope() { if (!--arena_.depth_) arena_.reset(); }
+    private:
+        ReadArena &arena_;
+    };
+
+private:
+    void reset();
+
+    static std::atomic<size_t> limit_;
+
+    std::unique_ptr<char[]> block_;
+    size_t size_;
+    size_t used_;
+    size_t required_;
+    int depth_;
+    std::vector<std::unique_ptr<char[]> > overflow_;
+};
+
+class Property;
+
+/**
+ * Updates set of ready properties. If io_uring is available, data of
+ * all properties is read by one batch of requests, otherwise
+ * properties are read one by one
+ */
+class BatchReader
+{
+public:
+    BatchReader();
+
+    bool isBatching() const { return uring_.isValid(); }
+    void update(Property * const *, size_t);
+
+private:
+    void complete(uint64_t, int);
+    void fallback();
+
+    struct Request
+    {
+        Property *property;
+        ReadBuffer buffer;
+    };
+
+    Uring uring_;
+    std::vector<Request> queued_;
+};
+
+/**
+ * Single epoll instance serving all properties of the monitor: one
+ * notifier is watching epoll descriptor, ready events are drained in
+ * batches and dispatched directly to properties
+ */
+class Poller : public QObject
+{
+    Q_OBJECT;
+public:
+    Poller();
+    virtual ~Poller();
+
+    bool add(int, Property *);
+    void remove(int);
+
+private slots:
+    void drain();
+
+private:
+    int fd_;
+    QScopedPointer<QSocketNotifier> notifier_;
+    BatchReader reader_;
+};
+
+/**
+ * Waits for missing property files to appear: namespace directories
+ * (or the nearest existing parent directories if namespace or statefs
+ * root is not created yet) are watched by the single inotify
+ * instance, waiting properties are resubscribed when expected entry
+ * is created
+ */
+class DirWatcher : public QObject
+{
+    Q_OBJECT;
+public:
+    DirWatcher();
+    virtual ~DirWatcher();
+
+    bool wait(Property *);
+    void cancel(Property *);
+
+private slots:
+    void onEvents();
+
+private:
+    struct Waiter
+    {
+        Property *property;
+        QByteArray child;
+    };
+
+    int watch(QByteArray, QByteArray, Property *);
+
+    int fd_;
+    QScopedPointer<QSocketNotifier> notifier_;
+    QHash<int, QList<Waiter> > waiters_;
+    QHash<Property*, QList<int> > watches_;
+};
+
+class TargetGroup;
+
+/**
+ * Limits rate of the subscriber notifications, enforced by the
+ * monitor, so suppressed changes are not passed to the subscriber
+ * thread at all. The latest value is delivered when limit expires
+ */
+struct RateLimit
+{
+    RateLimit(int interval_ms = 0, int debounce_ms = 0)
+        : interval(interval_ms), debounce(debounce_ms)
+    {}
+
+    bool isEmpty() const { return !interval && !debounce; }
+
+    bool operator ==(RateLimit const &that) const
+    {
+        return interval == that.interval && debounce == that.debounce;
+    }
+
+    /// minimal interval (ms) between notifications
+    int interval;
+    /// notification is sent when value is not changed for this time (ms)
+    int debounce;
+};
+
+class ChangeDispatcher;
+typedef std::shared_ptr<ChangeDispatcher> dispatcher_handle;
+
+/**
+ * Delivers change notifications from the monitor to the thread it
+ * belongs to. Created on demand in each thread subscribing to
+ * properties and shared by the thread and target groups, so it can
+ * outlive the thread: its receiver object is destroyed on the thread
+ * exit and groups posted after that are just released.
+ *
+ * Changed groups are collected into the intrusive lock-free list and
+ * only the first one posts wakeup event, so a burst of changes is
+ * handled in one pass: values of all changed subscribers are updated
+ * and then valueChanged is emitted for each of them
+ */
+class ChangeDispatcher
+{
+public:
+    static dispatcher_handle const & instance();
+    ~ChangeDispatcher();
+
+    void post(TargetGroup *);
+    void dispatch();
+
+private:
+    class Thread;
+    ChangeDispatcher();
+    ChangeDispatcher(ChangeDispatcher const&) = delete;
+    ChangeDispatcher & operator =(ChangeDispatcher const&) = delete;
+
+    void detach();
+    static void release(TargetGroup *);
+
+    std::atomic<TargetGroup*> pending_;
+    std::mutex mutex_;
+    // lives in the dispatcher thread, null after the thread is finished
+    QObject *receiver_;
+    // reused between passes, accessed only by the dispatcher thread
+    std::vector<target_handle> changed_;
+};
+
+/**
+ * Subscribers of one property living in the same thread. Monitor
+ * posts single event per group when property is changed and group
+ * members are updated by the receiving thread, so cross-thread
+ * traffic depends on the number of threads, not subscribers
+ */
+class TargetGroup : public std::enable_shared_from_this<TargetGroup>
+{
+public:
+    /// group is identified by the receiving thread and rate limit
+    struct Key
+    {
+        ChangeDispatcher *dispatcher;
+        RateLimit limit;
+
+        bool operator ==(Key const &that) const
+        {
+            return dispatcher == that.dispatcher && limit == that.limit;
+        }
+    };
+
+    TargetGroup(dispatcher_handle const &, RateLimit const &);
+
+    dispatcher_handle const & dispatcher() const { return dispatcher_; }
+    RateLimit const & limit() const { return limit_; }
+
+    // called from the monitor thread
+    bool add(target_handle const &);
+    bool remove(target_handle const &);
+    bool isMember(target_handle const &) const;
+    bool isEmpty() const;
+    void dataReady();
+    qint64 changed(qint64);
+    qint64 flush(qint64);
+
+    // called from the receiving thread
+    void deliver(std::vector<target_handle> &);
+
 private:
+    friend class ChangeDispatcher;
+
+    void notify(qint64);
+
+    dispatcher_handle dispatcher_;
+    RateLimit limit_;
+    // rate limiting state, accessed only by the monitor thread
+    qint64 last_;
+    qint64 deadline_;
+    bool is_pending_;
     mutable QMutex mutex_;
-    QVariant data_;
+    QSet<target_handle> targets_;
+    std::atomic_flag is_queued_;
+    // while group is queued it is linked into the dispatcher list
+    // and holds itself
+    TargetGroup *next_;
+    std::shared_ptr<TargetGroup> self_;
 };
 
+inline uint qHash(TargetGroup::Key const &key, uint seed = 0)
+{
+    return ::qHash(key.dispatcher, seed)
+        ^ ::qHash(key.limit.interval) ^ (::qHash(key.limit.debounce) << 1);
+}
+
 class Property : public QObject
 {
     Q_OBJECT;
 public:
     enum class Removed { No, Yes, Last };
 
-    Property(QString const &key, QObject *parent);
+    Property(PropertyKey const &key, QObject *parent
+             , Poller *poller = nullptr, DirWatcher *watcher = nullptr);
     virtual ~Property();
 
     QVariant subscribe();
+    QVariant subscribe(quint64 &);
     void unsubscribe();
 
     bool update();
 
-    bool add(target_handle const&);
+    bool add(target_handle const&, dispatcher_handle const &
+             , RateLimit const &);
     Removed remove(target_handle const &);
+    void setRateLimit(target_handle const&, RateLimit const &);
 
 private slots:
     void handleActivated(int);
     void trySubscribe();
+    void flushThrottled();
 
 private:
     bool tryOpen();
+    bool waitForFile();
+    bool isCreatedWhileWatching();
     void resubscribe();
-    QVariant subscribe_();
-    void changed() const;
+    bool subscribe_();
+    void changed();
+    void schedule(qint64);
+    void watch();
+    void unwatch();
+
+    bool beginUpdate();
+    bool updateBlob();
+    qint64 readFrom(ReadBuffer &, qint64);
+    bool endUpdate(ReadBuffer const &, qint64);
+
+    friend class Poller;
+    friend class BatchReader;
+    friend class DirWatcher;
+    friend MonitorStats monitorStats();
+    static MonitorCounters stats_;
 
     FileReader file_;
-    QByteArray buffer_;
+    Poller *poller_;
+    int polled_fd_;
+    DirWatcher *watcher_;
+    bool is_waiting_;
+    int type_;
+    bool is_blob_;
+    // size of the arena block for the next read
+    int read_size_;
+    // raw values are kept to skip decoding of the same data, short
+    // ones are kept inline, longer ones in the reused buffer
+    enum { max_raw_size = 32 };
+    char prev_raw_[max_raw_size];
+    QByteArray prev_long_raw_;
+    int prev_raw_size_;
+    quint64 prev_raw_hash_;
     mutable int reopen_interval_;
     mutable QTimer *reopen_timer_;
     bool is_subscribed_;
+    bool is_raw_valid_;
     std::shared_ptr<Cache> cache_;
-    QSet<target_handle> targets_;
+    // subscribers grouped by the receiving thread and rate limit
+    QHash<TargetGroup::Key, std::shared_ptr<TargetGroup> > groups_;
+    int targets_count_;
+    // notifications of rate limited groups are sent by timer
+    QElapsedTimer clock_;
+    QTimer *throttle_timer_;
+};
+
+/**
+ * Request to the monitor thread. Requests are passed through the
+ * CommandQueue and dispatched using the type tag
+ */
+class Command
+{
+public:
+    enum Type { Subscribe, Unsubscribe, Write, Refresh, Throttle };
+
+    virtual ~Command() {}
+    Type type() const { return type_; }
+
+protected:
+    Command(Type t) : type_(t), next_(nullptr) {}
+
+private:
+    Command(Command const &) = delete;
+    Command & operator =(Command const &) = delete;
+
+    friend class CommandQueue;
+    Type type_;
+    std::atomic<Command*> next_;
+};
+
+/**
+ * Lock-free intrusive multiple producers/single consumer queue of
+ * commands for the monitor thread. Consumer is woken up through
+ * eventfd, it is signaled only once until consumer starts to drain
+ * the queue
+ */
+class CommandQueue
+{
+public:
+    CommandQueue();
+    ~CommandQueue();
+
+    int fd() const { return fd_; }
+
+    void push(Command *);
+    Command *pop();
+    void wake();
+    void reset();
+
+private:
+    CommandQueue(CommandQueue const &) = delete;
+    CommandQueue & operator =(CommandQueue const &) = delete;
+
+    void link(Command *);
+
+    std::atomic<Command*> head_;
+    Command *tail_;
+    Command stub_;
+    std::atomic<bool> is_signaled_;
+    int fd_;
 };
 
 class SubscribeRequest;
 class UnsubscribeRequest;
 class WriteRequest;
 class RefreshRequest;
+class ThrottleRequest;
 
 class PropertyMonitor : public QObject
 {
     Q_OBJECT;
 public:
-    virtual bool event(QEvent *);
+    PropertyMonitor(CommandQueue *);
+    virtual ~PropertyMonitor();
 
     typedef qtaround::mt::ActorHandle monitor_ptr;
-    static monitor_ptr instance();
+    static monitor_ptr instance(PropertyKey const &);
+    static void post(PropertyKey const &, Command *);
+
+    enum { max_shards = 8 };
+    static size_t shard(PropertyKey const &);
+    static size_t shardsCount();
+    static void setShardsCount(size_t);
+
+private slots:
+    void drain();
+
 private:
+    void dispatch(Command *);
     void subscribe(SubscribeRequest*);
     void unsubscribe(UnsubscribeRequest*);
-    std::shared_ptr<Property> add(const QString &);
+    std::shared_ptr<Property> add(PropertyKey const &);
     void write(WriteRequest *);
+    std::shared_ptr<FileWriter> writer(PropertyKey const &);
     void refresh(RefreshRequest*);
+    void throttle(ThrottleRequest*);
 
+    CommandQueue *queue_;
+    QScopedPointer<QSocketNotifier> queue_notifier_;
+    // declared before properties to outlive them
+    Poller poller_;
+    DirWatcher watcher_;
     QMap<QString, std::shared_ptr<Property> > properties_;
-
-    static std::once_flag once_;
-    static monitor_ptr instance_;
+    struct CachedWriter
+    {
+        std::shared_ptr<FileWriter> writer;
+        // writers_clock_ value on the last use
+        quint64 used;
+    };
+    // least recently used writer is evicted if cache is full
+    QMap<QString, CachedWriter> writers_;
+    quint64 writers_clock_;
+
+    static std::atomic<size_t> requested_shards_;
+    static std::once_flag shards_once_;
+    static size_t shards_count_;
+    static std::array<std::once_flag, max_shards> once_;
+    static std::array<monitor_ptr, max_shards> instances_;
+    static std::array<std::unique_ptr<CommandQueue>, max_shards> queues_;
 };
 
-class ReplyEvent;
-class DataReadyEvent;
-
 }}
 
 class ContextPropertyPrivateHandle;
@@ -214,12 +698,13 @@ class ContextPropertyPrivate : public QObject
     Q_OBJECT;
 
 public:
-    explicit ContextPropertyPrivate(const QString &key);
+    explicit ContextPropertyPrivate(statefs::qt::PropertyKey const &key);
     virtual ~ContextPropertyPrivate();
 
     QString key() const;
     QVariant value(const QVariant &def) const;
     QVariant value() const;
+    quint64 generation() const { return generation_; }
 
     const ContextPropertyInfo* info() const;
 
@@ -233,8 +718,8 @@ public:
     static void setTypeCheck(bool typeCheck);
 
     void refresh() const;
+    void setRateLimit(statefs::qt::RateLimit const &) const;
 
-    void postEvent(statefs::qt::ReplyEvent *);
     virtual bool event(QEvent *);
 
 signals:
@@ -246,7 +731,7 @@ private:
     friend class ContextPropertyPrivateHandle;
 
     void detach();
-    void onChanged(QVariant) const;
+    bool onChanged(QVariant) const;
 
     enum State {
         Initial,
@@ -257,24 +742,32 @@ private:
 
     bool update(QVariant const&) const;
     bool waitForUnsubscription() const;
-    static statefs::qt::PropertyMonitor::monitor_ptr actor();
-    QString key_;
+    statefs::qt::PropertyKey key_;
     mutable State state_;
     mutable bool is_cached_;
     mutable QVariant cache_;
-
-    mutable std::future<QVariant> on_subscribed_;
-    mutable std::future<void> on_unsubscribed_;
+    // generation of the remote cache value consumed last time
+    mutable quint64 generation_;
+
+    mutable statefs::qt::Completion on_subscribed_;
+    mutable statefs::qt::Completion on_unsubscribed_;
+    // written by the monitor before on_subscribed_ is completed
+    mutable QVariant subscribed_value_;
+    mutable quint64 subscribed_generation_;
     mutable QSharedPointer<ContextPropertyPrivate> handle_;
 
     // TODO move functionality to the separate interface
     friend class statefs::qt::Property;
     friend class statefs::qt::SubscribeRequest;
+    friend class statefs::qt::UnsubscribeRequest;
+    friend class statefs::qt::TargetGroup;
     void attachCache(std::shared_ptr<statefs::qt::Cache>) const;
-    void dataReady(statefs::qt::target_handle);
-    void updateFromRemoteCache(statefs::qt::DataReadyEvent *);
+    void dataReady();
+    bool updateFromRemoteCache();
 
+    mutable statefs::qt::RateLimit rate_limit_;
     mutable std::weak_ptr<statefs::qt::Cache> remote_cache_;
+    mutable QScopedPointer<ContextPropertyInfo> info_;
     mutable std::atomic_flag update_queued_;
 };
 
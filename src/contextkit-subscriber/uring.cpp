@@ -0,0 +1,251 @@
+#include "uring.hpp"
+
+#include <qtaround/debug.hpp>
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef STATEFS_QT_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace debug = qtaround::debug;
+
+namespace statefs { namespace qt {
+
+#ifdef STATEFS_QT_IO_URING
+
+namespace {
+
+int uringSetup(unsigned entries, io_uring_params *params)
+{
+    return ::syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uringEnter(int fd, unsigned to_submit, unsigned min_complete
+               , unsigned flags)
+{
+    return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete
+                     , flags, nullptr, 0);
+}
+
+template <typename T>
+T * ringPtr(void *ring, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+void * mapRing(int fd, size_t size, off_t offset)
+{
+    auto res = ::mmap(nullptr, size, PROT_READ | PROT_WRITE
+                      , MAP_SHARED | MAP_POPULATE, fd, offset);
+    return res == MAP_FAILED ? nullptr : res;
+}
+
+}
+
+Uring::Uring(unsigned entries)
+    : fd_(-1), sq_entries_(0), pending_(0), in_flight_(0)
+    , sq_ring_(nullptr), sq_ring_size_(0)
+    , cq_ring_(nullptr), cq_ring_size_(0)
+    , sqes_(nullptr), sqes_size_(0)
+{
+    io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+    fd_ = uringSetup(entries, &params);
+    if (fd_ < 0) {
+        debug::info("io_uring is not available:", ::strerror(errno));
+        return;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes
+        + params.cq_entries * sizeof(io_uring_cqe);
+    auto is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (is_single_mmap) {
+        if (cq_ring_size_ > sq_ring_size_)
+            sq_ring_size_ = cq_ring_size_;
+        cq_ring_size_ = 0;
+    }
+    sq_ring_ = mapRing(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+    if (!sq_ring_) {
+        close();
+        return;
+    }
+    cq_ring_ = is_single_mmap
+        ? sq_ring_
+        : mapRing(fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+    if (!cq_ring_) {
+        close();
+        return;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>
+        (mapRing(fd_, sqes_size_, IORING_OFF_SQES));
+    if (!sqes_) {
+        close();
+        return;
+    }
+
+    sq_entries_ = params.sq_entries;
+    sq_head_ = ringPtr<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = ringPtr<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_mask_ = *ringPtr<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = ringPtr<unsigned>(sq_ring_, params.sq_off.array);
+    cq_head_ = ringPtr<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = ringPtr<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = *ringPtr<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = ringPtr<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+}
+
+Uring::~Uring()
+{
+    close();
+}
+
+void Uring::close()
+{
+    if (sqes_)
+        ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+        ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_)
+        ::munmap(sq_ring_, sq_ring_size_);
+    sqes_ = nullptr;
+    cq_ring_ = sq_ring_ = nullptr;
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+    sq_entries_ = 0;
+    pending_ = in_flight_ = 0;
+}
+
+/**
+ * queue read request, it is submitted by submit()
+ *
+ * @return false if submission queue is full
+ */
+bool Uring::read(int fd, void *buf, unsigned len, off_t offset, uint64_t tag)
+{
+    auto tail = *sq_tail_;
+    auto head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head >= sq_entries_)
+        return false;
+
+    auto index = tail & sq_mask_;
+    auto sqe = &sqes_[index];
+    ::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++pending_;
+    return true;
+}
+
+/**
+ * submit all queued requests and wait for wait_count completions
+ *
+ * @return number of submitted requests or -errno
+ */
+int Uring::submit(unsigned wait_count)
+{
+    auto flags = wait_count ? IORING_ENTER_GETEVENTS : 0;
+    int rc;
+    do {
+        rc = uringEnter(fd_, pending_, wait_count, flags);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0)
+        return -errno;
+    pending_ -= rc;
+    in_flight_ += rc;
+    return rc;
+}
+
+/**
+ * wait for count completions without submitting queued requests
+ *
+ * @return 0 or -errno
+ */
+int Uring::wait(unsigned count)
+{
+    int rc;
+    do {
+        rc = uringEnter(fd_, 0, count, IORING_ENTER_GETEVENTS);
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -errno : 0;
+}
+
+io_uring_cqe const & Uring::completion(unsigned index) const
+{
+    return cqes_[index];
+}
+
+uint64_t Uring::tag(io_uring_cqe const &cqe)
+{
+    return cqe.user_data;
+}
+
+int Uring::result(io_uring_cqe const &cqe)
+{
+    return cqe.res;
+}
+
+#else // STATEFS_QT_IO_URING
+
+Uring::Uring(unsigned)
+    : fd_(-1), sq_entries_(0), pending_(0), in_flight_(0)
+    , sq_ring_(nullptr), sq_ring_size_(0)
+    , cq_ring_(nullptr), cq_ring_size_(0)
+    , sqes_(nullptr), sqes_size_(0)
+{
+}
+
+Uring::~Uring()
+{
+}
+
+void Uring::close()
+{
+}
+
+bool Uring::read(int, void *, unsigned, off_t, uint64_t)
+{
+    return false;
+}
+
+int Uring::submit(unsigned)
+{
+    return -ENOSYS;
+}
+
+int Uring::wait(unsigned)
+{
+    return -ENOSYS;
+}
+
+io_uring_cqe const & Uring::completion(unsigned) const
+{
+    return *cqes_;
+}
+
+uint64_t Uring::tag(io_uring_cqe const &)
+{
+    return 0;
+}
+
+int Uring::result(io_uring_cqe const &)
+{
+    return -ENOSYS;
+}
+
+#endif // STATEFS_QT_IO_URING
+
+}}
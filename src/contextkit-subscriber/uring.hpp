@@ -0,0 +1,82 @@
+#ifndef _STATEFS_CKIT_URING_HPP_
+#define _STATEFS_CKIT_URING_HPP_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace statefs { namespace qt {
+
+/**
+ * Minimal io_uring wrapper used to submit batch of reads with one
+ * system call. Implemented on top of raw system calls to avoid
+ * dependency on liburing. If kernel does not support io_uring (or it
+ * is disabled at build time) isValid() returns false and caller
+ * should use ordinary read()
+ */
+class Uring
+{
+public:
+    Uring(unsigned entries);
+    ~Uring();
+
+    bool isValid() const { return fd_ >= 0; }
+    unsigned capacity() const { return sq_entries_; }
+    /// number of submitted requests not completed yet
+    unsigned inFlight() const { return in_flight_; }
+
+    bool read(int fd, void *buf, unsigned len, off_t offset, uint64_t tag);
+    int submit(unsigned wait_count);
+    int wait(unsigned count);
+    void close();
+
+    template <typename FnT>
+    unsigned complete(FnT fn)
+    {
+        unsigned count = 0;
+        auto head = *cq_head_;
+        auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++count) {
+            auto const &cqe = completion(head & cq_mask_);
+            fn(tag(cqe), result(cqe));
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        in_flight_ -= count;
+        return count;
+    }
+
+private:
+    Uring(Uring const&) = delete;
+    Uring & operator =(Uring const&) = delete;
+
+    io_uring_cqe const & completion(unsigned) const;
+    static uint64_t tag(io_uring_cqe const &);
+    static int result(io_uring_cqe const &);
+
+    int fd_;
+    unsigned sq_entries_;
+    unsigned pending_;
+    unsigned in_flight_;
+
+    void *sq_ring_;
+    size_t sq_ring_size_;
+    void *cq_ring_;
+    size_t cq_ring_size_;
+    io_uring_sqe *sqes_;
+    size_t sqes_size_;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+};
+
+}}
+
+#endif // _STATEFS_CKIT_URING_HPP_
@@ -0,0 +1,208 @@
+/**
+ * @file snapshot.cpp
+ * @brief Bulk read of statefs namespace
+ * @copyright (C) 2013-2014 Jolla Ltd.
+ * @par License: LGPL 2.1 http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html
+ */
+
+#include <statefs/qt/snapshot.hpp>
+#include <statefs/qt/util.hpp>
+#include <qtaround/debug.hpp>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace debug = qtaround::debug;
+
+namespace statefs { namespace qt {
+
+namespace {
+
+// there is no sense to start thread to read only few files
+const size_t min_per_thread = 16;
+const int max_threads = 4;
+const size_t max_file_size = 1024 * 1024;
+
+QThreadPool &workers()
+{
+    static QThreadPool pool;
+    static std::once_flag once;
+    std::call_once(once, []() {
+            pool.setMaxThreadCount
+                (std::max(1, std::min(max_threads
+                                      , QThread::idealThreadCount())));
+        });
+    return pool;
+}
+
+class Task : public QRunnable
+{
+public:
+    Task(std::function<void()> fn, QSemaphore &done)
+        : fn_(std::move(fn)), done_(done)
+    {}
+
+    virtual void run()
+    {
+        fn_();
+        done_.release();
+    }
+
+private:
+    std::function<void()> fn_;
+    QSemaphore &done_;
+};
+
+/// namespace is looked up in the session and then in the system root
+DIR *openNamespace(QString const &ns)
+{
+    for (auto const &root : {getNamespacesRoot(), getSystemNamespacesRoot()}) {
+        auto path = QFile::encodeName(root + "/" + ns);
+        auto fd = ::open(path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        auto res = ::fdopendir(fd);
+        if (res)
+            return res;
+        ::close(fd);
+    }
+    return nullptr;
+}
+
+bool readFile(int dir_fd, char const *name, std::vector<char> &buf
+              , qint64 &size)
+{
+    auto fd = ::openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    qint64 rc = 0;
+    while (true) {
+        auto to_read = buf.size() - rc;
+        auto len = ::pread(fd, buf.data() + rc, to_read, rc);
+        if (len < 0) {
+            rc = len;
+            break;
+        }
+        rc += len;
+        if ((size_t)len < to_read)
+            break;
+        if (buf.size() >= max_file_size) {
+            // value is truncated, it is reported as failed
+            debug::warning("File size for", name, "reached max"
+                           , max_file_size);
+            rc = -1;
+            break;
+        }
+        buf.resize(std::min(buf.size() * 2, max_file_size));
+    }
+    ::close(fd);
+    size = rc;
+    return rc >= 0;
+}
+
+}
+
+Snapshot::Snapshot()
+    : stats_{0, 0, 0, 0, 0}
+{
+}
+
+/**
+ * read all properties of the namespace
+ *
+ * @param ns namespace name
+ *
+ * @return snapshot, it is empty if namespace is not found
+ */
+Snapshot Snapshot::read(QString const &ns)
+{
+    Snapshot res;
+    QElapsedTimer timer;
+    timer.start();
+
+    auto dir = openNamespace(ns);
+    if (!dir) {
+        debug::warning("Can't open namespace", ns);
+        return res;
+    }
+
+    std::vector<QByteArray> names;
+    while (auto entry = ::readdir(dir)) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+            continue;
+        names.emplace_back(entry->d_name);
+    }
+    res.stats_.list_ns = timer.nsecsElapsed();
+    timer.restart();
+
+    auto count = names.size();
+    std::vector<QString> keys(count);
+    std::vector<QVariant> values(count);
+    std::vector<char> is_read(count, 0);
+    auto prefix = ns + ".";
+    for (size_t i = 0; i < count; ++i)
+        keys[i] = prefix + QFile::decodeName(names[i]);
+
+    auto dir_fd = ::dirfd(dir);
+    auto read_range = [&](size_t begin, size_t end) {
+        std::vector<char> buf(256);
+        for (auto i = begin; i < end; ++i) {
+            qint64 size = 0;
+            if (!readFile(dir_fd, names[i].constData(), buf, size))
+                continue;
+            auto type = getPropertyType(keys[i]);
+            auto len = qstrnlen(buf.data(), size);
+            values[i] = (len
+                         ? valueDecodeRaw(buf.data(), len, type)
+                         : valueDecode(QString(""), type));
+            is_read[i] = 1;
+        }
+    };
+
+    // calling thread reads the first part
+    auto &pool = workers();
+    auto threads = std::max<size_t>
+        (1, std::min<size_t>(pool.maxThreadCount() + 1
+                             , count / min_per_thread));
+    auto per_thread = (count + threads - 1) / threads;
+    QSemaphore done;
+    for (size_t t = 1; t < threads; ++t) {
+        auto begin = std::min(count, t * per_thread);
+        auto end = std::min(count, begin + per_thread);
+        pool.start(new Task([&read_range, begin, end]() {
+                    read_range(begin, end);
+                }, done));
+    }
+    read_range(0, std::min(count, per_thread));
+    done.acquire(threads - 1);
+    ::closedir(dir);
+
+    res.values_.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (is_read[i])
+            res.values_.insert(keys[i], values[i]);
+        else
+            ++res.stats_.failed;
+    }
+    res.stats_.count = res.values_.size();
+    res.stats_.threads = threads;
+    res.stats_.read_ns = timer.nsecsElapsed();
+    return res;
+}
+
+}}
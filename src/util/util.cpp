@@ -9,12 +9,25 @@
 #include <cor/error.hpp>
 #include <qtaround/debug.hpp>
 
-#include <QRegExp>
 #include <QDebug>
 #include <QDate>
 #include <QDateTime>
 #include <QDir>
 #include <QFile>
+#include <QHash>
+#include <QReadWriteLock>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdio.h>
+#include <errno.h>
+#include <locale.h>
+#include <langinfo.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 namespace debug = qtaround::debug;
 
@@ -28,6 +41,23 @@ namespace qt {
  * @{
  */
 
+namespace {
+
+inline bool isSeparator(QChar c)
+{
+    return c == '.' || c == '/';
+}
+
+QString nsFromParts(QString ns)
+{
+    for (auto &c : ns)
+        if (isSeparator(c))
+            c = '_';
+    return ns;
+}
+
+}
+
 /**
  * split full property name (dot- or slash-separated) to statefs path
  * parts relative to the namespace/provider root directory
@@ -39,26 +69,97 @@ namespace qt {
  */
 bool splitPropertyName(const QString &name, QStringList &parts)
 {
-    QRegExp re("[./]");
-    re.setPatternSyntax(QRegExp::RegExp);
-    parts = name.split(re);
-    if (!parts.size()) {
+    parts.clear();
+    PropertyKey key(name);
+    if (!key.isValid()) {
         debug::warning("Can't parse property name:", name);
         return false;
     }
+    // should be 2 parts: namespace and property_name
+    parts.push_back(key.ns());
+    parts.push_back(key.name());
+    return true;
+}
 
-    if (parts.size() > 2) {
-        auto fname = parts.last();
-        parts.pop_back();
-        if (!parts[0].size()) // for names like "/..."
-            parts.pop_front();
-        auto ns = parts.join("_");
-        parts.clear();
-        parts.push_back(ns);
-        parts.push_back(fname);
+/**
+ * split property name to the namespace and name. If there are more
+ * than 2 parts, all parts except the last one are joined with '_' to
+ * form the namespace name (leading separator is ignored)
+ */
+PropertyKey::PropertyKey(QString const &key)
+    : key_(key)
+    , is_valid_(false)
+{
+    auto begin = key.constData(), end = begin + key.size();
+    auto last = end;
+    while (last != begin && !isSeparator(*(last - 1)))
+        --last;
+    if (last == begin)
+        return;
+
+    auto ns_end = last - 1;
+    auto ns_begin = begin;
+    auto first = std::find_if(begin, ns_end, isSeparator);
+    if (first != ns_end) {
+        if (first == begin) // for names like "/..."
+            ++ns_begin;
+        ns_ = nsFromParts(QString(ns_begin, ns_end - ns_begin));
+    } else {
+        ns_ = QString(ns_begin, ns_end - ns_begin);
     }
-    // should be 2 parts: namespace and property_name
-    return (parts.size() == 2);
+    name_ = QString(last, end - last);
+    is_valid_ = true;
+}
+
+/// Key parts are known at compile time, so there is no parsing
+PropertyKey::PropertyKey(Key const &key)
+    : key_(key.key())
+    , ns_(key.ns())
+    , name_(key.name())
+    , is_valid_(key.isValid())
+{
+}
+
+QString Key::key() const
+{
+    return QString::fromUtf8(name_, size_);
+}
+
+QString Key::ns() const
+{
+    if (!isValid())
+        return QString();
+    auto res = QString::fromUtf8(name_ + ns_begin_, name_pos_ - 1 - ns_begin_);
+    return ns_has_separators_ ? nsFromParts(std::move(res)) : res;
+}
+
+QString Key::name() const
+{
+    return (isValid()
+            ? QString::fromUtf8(name_ + name_pos_, size_ - name_pos_)
+            : QString());
+}
+
+/**
+ * @return path to the namespaces directory of the statefs instance
+ * mounted to the default statefs root
+ */
+QString getNamespacesRoot()
+{
+    QStringList parts;
+    parts.push_back(::getenv("XDG_RUNTIME_DIR")); // TODO hardcoded source!
+    parts.push_back("state");
+    parts.push_back("namespaces");
+    return parts.join(QDir::separator());
+}
+
+/**
+ * @return path to the namespaces directory of the statefs system
+ * instance mounted to the default statefs root
+ */
+QString getSystemNamespacesRoot()
+{
+    return "/run/state/namespaces"; // TODO hardcoded source!
 }
 
 /**
@@ -71,15 +172,28 @@ bool splitPropertyName(const QString &name, QStringList &parts)
  */
 QString getPath(const QString &name)
 {
-    QStringList parts;
-    if (!splitPropertyName(name, parts)) {
-        debug::warning("can't split '", name, "'");
+    return getPath(PropertyKey(name));
+}
+
+/**
+ * get path to the statefs property file for the statefs instance
+ * mounted to the default statefs root
+ *
+ * @param key property key split to the namespace and name
+ *
+ * @return full path to the property file
+ */
+QString getPath(PropertyKey const &key)
+{
+    if (!key.isValid()) {
+        debug::warning("can't split '", key.key(), "'");
         return "";
     }
 
-    parts.push_front("namespaces");
-    parts.push_front("state");
-    parts.push_front(::getenv("XDG_RUNTIME_DIR")); // TODO hardcoded source!
+    QStringList parts;
+    parts.push_back(getNamespacesRoot());
+    parts.push_back(key.ns());
+    parts.push_back(key.name());
 
     return parts.join(QDir::separator());
 }
@@ -94,45 +208,326 @@ QString getPath(const QString &name)
  */
 QString getSystemPath(const QString &name)
 {
-    QStringList parts;
-    if (!splitPropertyName(name, parts))
+    return getSystemPath(PropertyKey(name));
+}
+
+/**
+ * get path to the statefs property file for the statefs system
+ * instance mounted to the default statefs root
+ *
+ * @param key property key split to the namespace and name
+ *
+ * @return full path to the property file
+ */
+QString getSystemPath(PropertyKey const &key)
+{
+    if (!key.isValid())
         return "";
 
-    parts.push_front("/run/state/namespaces"); // TODO hardcoded source!
+    QStringList parts;
+    parts.push_back(getSystemNamespacesRoot());
+    parts.push_back(key.ns());
+    parts.push_back(key.name());
 
     return parts.join(QDir::separator());
 }
 
-static QRegExp re(QString const &cs)
+namespace {
+
+/**
+ * Result of the single pass scan of the property value text. Number
+ * is accumulated while scanning, so integer values do not need to be
+ * parsed once more.
+ */
+struct ScanResult
 {
-	auto in_spaces = [](QString const& s) {
-		static const QString aspaces = "\\s*";
-		return aspaces + s + aspaces;
-	};
-	return QRegExp(in_spaces(cs), Qt::CaseSensitive, QRegExp::RegExp2);
+    ScanResult() : type(QVariant::String), is_negative(false)
+                 , is_overflow(false), number(0) {}
+
+    QVariant::Type type;
+    bool is_negative;
+    bool is_overflow;
+    qulonglong number;
 };
 
-static const QString date_re("[0-9]{4}-[0-9]{2}-[0-9]{2}");
-static const QString hhmm_re("[0-9]{2}:[0-9]{2}");
-static const QString time_re(QString("%1(:[0-9]{2})?").arg(hhmm_re));
-static const QString tz_re("(Z|[+-][0-9]{2}(:[0-9]{2})?)");
-static const QString datetime_re(QString("%1T%2%3")
-								 .arg(date_re, time_re, tz_re));
-
-
-static const std::initializer_list<std::pair<QRegExp, QVariant::Type> > re_types
-= {{re("[+-][0-9]+"), QVariant::Int}
-   , {re("[0-9]{11,}"), QVariant::String}
-   , {re("[0-9]+"), QVariant::UInt}
-   , {re("[+-]?([0-9]+\\.[0-9]*|[0-9]*\\.[0-9]+)"), QVariant::Double}
-   , {re(date_re), QVariant::Date}
-   , {re(time_re), QVariant::Time}
-   , {re(datetime_re), QVariant::DateTime}
+inline bool isSpace(QChar c) { return c.isSpace(); }
+inline bool isDigit(QChar c) { return c >= '0' && c <= '9'; }
+inline unsigned digitValue(QChar c) { return c.unicode() - '0'; }
+
+inline bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+inline unsigned digitValue(char c) { return c - '0'; }
+
+template <typename CharT>
+class ValueScanner
+{
+public:
+    ValueScanner(CharT const *begin, CharT const *end)
+        : pos_(begin), end_(end)
+    {}
+
+    /**
+     * classify value using the same rules as regular expressions
+     * used before (in the order of precedence):
+     *
+     * - [+-][0-9]+ - Int
+     * - [0-9]{11,} - String (too long to be UInt)
+     * - [0-9]+ - UInt
+     * - [+-]?([0-9]+\.[0-9]*|[0-9]*\.[0-9]+) - Double
+     * - YYYY-MM-DD - Date
+     * - hh:mm(:ss)? - Time
+     * - YYYY-MM-DDThh:mm(:ss)?(Z|[+-]hh(:mm)?) - DateTime
+     *
+     * Leading and trailing spaces are ignored. Everything else is
+     * String
+     */
+    ScanResult scan()
+    {
+        ScanResult res;
+        while (pos_ != end_ && isSpace(*pos_))
+            ++pos_;
+        while (end_ != pos_ && isSpace(*(end_ - 1)))
+            --end_;
+        if (pos_ == end_)
+            return res;
+
+        bool has_sign = false;
+        if (*pos_ == '+' || *pos_ == '-') {
+            has_sign = true;
+            res.is_negative = (*pos_ == '-');
+            ++pos_;
+        }
+
+        auto int_digits = number(res);
+        if (pos_ == end_) {
+            if (int_digits)
+                res.type = (has_sign
+                            ? QVariant::Int
+                            : (int_digits > 10
+                               ? QVariant::String
+                               : QVariant::UInt));
+            return res;
+        }
+
+        if (*pos_ == '.') {
+            ++pos_;
+            auto frac_digits = skipDigits();
+            if (pos_ == end_ && (int_digits || frac_digits))
+                res.type = QVariant::Double;
+            return res;
+        }
+
+        if (has_sign)
+            return res;
+
+        if (int_digits == 4 && *pos_ == '-') {
+            if (!(skip('-') && digits(2) && skip('-') && digits(2)))
+                return res;
+            if (pos_ == end_) {
+                res.type = QVariant::Date;
+            } else if (skip('T') && time() && timezone() && pos_ == end_) {
+                res.type = QVariant::DateTime;
+            }
+        } else if (int_digits == 2 && *pos_ == ':') {
+            if (skip(':') && digits(2) && (pos_ == end_ || time_seconds())
+                && pos_ == end_)
+                res.type = QVariant::Time;
+        }
+        return res;
+    }
+
+private:
+
+    size_t number(ScanResult &res)
+    {
+        static const qulonglong max_prefix = ~0ULL / 10;
+        size_t count = 0;
+        for (; pos_ != end_ && isDigit(*pos_); ++pos_, ++count) {
+            auto d = digitValue(*pos_);
+            if (res.number > max_prefix
+                || (res.number == max_prefix && d > ~0ULL % 10))
+                res.is_overflow = true;
+            res.number = res.number * 10 + d;
+        }
+        return count;
+    }
+
+    size_t skipDigits()
+    {
+        size_t count = 0;
+        for (; pos_ != end_ && isDigit(*pos_); ++pos_)
+            ++count;
+        return count;
+    }
+
+    bool digits(size_t count)
+    {
+        for (; count; --count, ++pos_)
+            if (pos_ == end_ || !isDigit(*pos_))
+                return false;
+        return true;
+    }
+
+    bool skip(char c)
+    {
+        if (pos_ == end_ || *pos_ != c)
+            return false;
+        ++pos_;
+        return true;
+    }
+
+    bool time_seconds()
+    {
+        return skip(':') && digits(2);
+    }
+
+    bool time()
+    {
+        if (!(digits(2) && skip(':') && digits(2)))
+            return false;
+        return (pos_ == end_ || *pos_ != ':' || time_seconds());
+    }
+
+    bool timezone()
+    {
+        if (skip('Z'))
+            return true;
+        if (!(skip('+') || skip('-')) || !digits(2))
+            return false;
+        return (pos_ == end_ || *pos_ != ':' || time_seconds());
+    }
+
+    CharT const *pos_;
+    CharT const *end_;
 };
 
+QVariant integerValue(ScanResult const &scanned)
+{
+    static const qulonglong max_positive = LLONG_MAX;
+    if (scanned.type == QVariant::UInt)
+        return QVariant(static_cast<uint>(scanned.number));
+
+    if (scanned.is_overflow
+        || scanned.number > max_positive + (scanned.is_negative ? 1 : 0))
+        return QVariant();
+    // the same truncation QVariant::convert does for String -> Int
+    return QVariant(static_cast<int>
+                    (static_cast<qlonglong>(scanned.is_negative
+                                            ? 0ULL - scanned.number
+                                            : scanned.number)));
+}
+
+bool isAscii(char const *data, size_t size)
+{
+    for (auto end = data + size; data != end; ++data)
+        if (static_cast<unsigned char>(*data) & 0x80)
+            return false;
+    return true;
+}
+
+unsigned digitsValue(char const *data, size_t count)
+{
+    unsigned res = 0;
+    for (auto end = data + count; data != end; ++data)
+        res = res * 10 + digitValue(*data);
+    return res;
+}
+
+/// numbers are parsed/formatted using C locale, application can set
+/// other numeric locale
+locale_t cLocale()
+{
+    static const locale_t c_locale = ::newlocale(LC_ALL_MASK, "C", (locale_t)0);
+    return c_locale;
+}
+
+/**
+ * parse double using C locale. Data is copied to the stack buffer to
+ * be zero-terminated, so only short strings are parsed
+ */
+bool parseDouble(char const *data, size_t size, double &res)
+{
+    static const size_t max_size = 64;
+    auto c_locale = cLocale();
+    if (size >= max_size || !c_locale)
+        return false;
+
+    char buf[max_size];
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    char *end = nullptr;
+    errno = 0;
+    res = ::strtod_l(buf, &end, c_locale);
+    return (errno != ERANGE && end != buf);
+}
+
+QVariant rawValueDecode(char const *data, size_t size)
+{
+    auto scanned = ValueScanner<char>(data, data + size).scan();
+    switch (scanned.type) {
+    case QVariant::String:
+        return QVariant(QString::fromLatin1(data, size));
+    case QVariant::Int:
+    case QVariant::UInt:
+        return integerValue(scanned);
+    case QVariant::Double: {
+        double d;
+        return parseDouble(data, size, d) ? QVariant(d) : QVariant();
+    }
+    case QVariant::Date:
+        // only exact YYYY-MM-DD, QDate::fromString is used to process
+        // corner cases (surrounding spaces)
+        return (size == 10 && isDigit(data[0])
+                ? QVariant(QDate(digitsValue(data, 4)
+                                 , digitsValue(data + 5, 2)
+                                 , digitsValue(data + 8, 2)))
+                : QVariant());
+    default:
+        return QVariant();
+    }
+}
+
+QVariant rawValueDecode(char const *data, size_t size, int type)
+{
+    auto scanned = ValueScanner<char>(data, data + size).scan();
+    auto is_integer = (scanned.type == QVariant::Int
+                       || scanned.type == QVariant::UInt);
+    switch (type) {
+    case QVariant::Int: {
+        static const qulonglong max_int = INT_MAX;
+        if (!is_integer || scanned.is_overflow)
+            break;
+        if (scanned.number <= max_int) {
+            auto n = static_cast<int>(scanned.number);
+            return QVariant(scanned.is_negative ? -n : n);
+        }
+        if (scanned.is_negative && scanned.number == max_int + 1)
+            return QVariant(INT_MIN);
+        break;
+    }
+    case QVariant::UInt:
+        if (scanned.type == QVariant::UInt && scanned.number <= UINT_MAX)
+            return QVariant(static_cast<uint>(scanned.number));
+        break;
+    case QVariant::Double: {
+        double d;
+        if ((is_integer || scanned.type == QVariant::Double)
+            && parseDouble(data, size, d))
+            return QVariant(d);
+        break;
+    }
+    default:
+        break;
+    }
+    return QVariant();
+}
+
+}
+
 /**
  * try to convert input string to QVariant using simple
- * heuristics.
+ * heuristics. Value is classified in the single pass, integer values
+ * are parsed at the same time.
  *
  * @param s input string
  *
@@ -141,24 +536,221 @@ static const std::initializer_list<std::pair<QRegExp, QVariant::Type> > re_types
  */
 QVariant valueDecode(QString const& s)
 {
-	if (!s.size())
-		return QVariant(s);
+    if (!s.size())
+        return QVariant(s);
+
+    auto begin = s.constData();
+    auto scanned = ValueScanner<QChar>(begin, begin + s.size()).scan();
+    QVariant v;
+    switch (scanned.type) {
+    case QVariant::String:
+        return QVariant(s);
+    case QVariant::Int:
+    case QVariant::UInt:
+        v = integerValue(scanned);
+        break;
+    case QVariant::Double: {
+        bool is_ok = false;
+        auto d = s.toDouble(&is_ok);
+        if (is_ok)
+            v = QVariant(d);
+        break;
+    }
+    default:
+        break;
+    }
+    if (!v.isValid()) {
+        // dates/times and numbers out of range are converted by Qt
+        v = QVariant(s);
+        v.convert(scanned.type);
+    }
+    return v;
+}
+
+/**
+ * decode value directly from the raw (UTF-8) data read from the
+ * property file. Numbers and dates are parsed from ASCII bytes, so
+ * QString is only created for string values or rare corner cases.
+ *
+ * @param data property data
+ * @param size data size
+ * @param type declared property type or QVariant::Invalid to use
+ * heuristics
+ *
+ * @return decoded value, the same as returned by valueDecode() for
+ * the string constructed from data
+ */
+QVariant valueDecodeRaw(char const *data, size_t size, int type)
+{
+    if (type == blobType())
+        return QVariant::fromValue(Blob(QByteArray(data, size)));
+
+    QVariant v;
+    if (size && isAscii(data, size)) {
+        switch (type) {
+        case QVariant::Invalid:
+            v = rawValueDecode(data, size);
+            break;
+        case QVariant::String:
+            return QVariant(QString::fromLatin1(data, size));
+        case QVariant::Int:
+        case QVariant::UInt:
+        case QVariant::Double:
+            v = rawValueDecode(data, size, type);
+            break;
+        default:
+            break;
+        }
+    }
+    return (v.isValid()
+            ? v
+            : valueDecode(QString::fromUtf8(data, size), type));
+}
+
+/**
+ * convert input string to the value of the declared type without
+ * using heuristics. If type is not declared (QVariant::Invalid)
+ * valueDecode(QString const&) is used.
+ *
+ * @param s input string
+ * @param type declared property type
+ *
+ * @return value of the declared type, default value of this type if
+ * string can't be converted
+ */
+QVariant valueDecode(QString const& s, int type)
+{
+    if (type == blobType())
+        return QVariant::fromValue(Blob(s.toUtf8()));
+
+    bool is_ok = true;
+    QVariant v;
+    switch (type) {
+    case QVariant::Invalid:
+        return valueDecode(s);
+    case QVariant::String:
+        return QVariant(s);
+    case QVariant::Int:
+        v = s.toInt(&is_ok);
+        break;
+    case QVariant::UInt:
+        v = s.toUInt(&is_ok);
+        break;
+    case QVariant::LongLong:
+        v = s.toLongLong(&is_ok);
+        break;
+    case QVariant::ULongLong:
+        v = s.toULongLong(&is_ok);
+        break;
+    case QVariant::Double:
+        v = s.toDouble(&is_ok);
+        break;
+    default:
+        v = QVariant(s.trimmed());
+        is_ok = v.convert(type);
+        break;
+    }
+    return is_ok ? v : valueDefault(QVariant(type, nullptr));
+}
+
+namespace {
+
+int formatInteger(qulonglong v, bool is_negative, char *dst, size_t size)
+{
+    char digits[24];
+    auto p = digits + sizeof(digits);
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (is_negative)
+        *--p = '-';
+    size_t len = digits + sizeof(digits) - p;
+    if (len > size)
+        return -1;
+    memcpy(dst, p, len);
+    return len;
+}
+
+int formatInteger(qlonglong v, char *dst, size_t size)
+{
+    return (v < 0
+            ? formatInteger(0ULL - static_cast<qulonglong>(v), true, dst, size)
+            : formatInteger(static_cast<qulonglong>(v), false, dst, size));
+}
 
-	QVariant v(s);
-	for (auto const& re_type : re_types) {
-		if (re_type.first.exactMatch(s)) {
-			v.convert(re_type.second);
-			break;
-		}
-	}
-	return v;
+/**
+ * shortest representation of the double which is parsed back to the
+ * same value: precision is increased until value roundtrips, 17
+ * significant digits always roundtrip. Thread locale is switched to
+ * "C" only if its decimal point is not '.'
+ */
+int formatDouble(double v, char *dst, size_t size)
+{
+    auto c_locale = cLocale();
+    if (!std::isfinite(v) || !c_locale)
+        return -1;
+
+    auto point = ::nl_langinfo(RADIXCHAR);
+    auto prev_locale = ((point[0] == '.' && !point[1])
+                        ? (locale_t)0 : ::uselocale(c_locale));
+    int len = -1;
+    for (auto precision = 15; precision <= 17; ++precision) {
+        len = ::snprintf(dst, size, "%.*g", precision, v);
+        if (len < 0 || static_cast<size_t>(len) >= size) {
+            len = -1;
+            break;
+        }
+        if (precision == 17 || ::strtod_l(dst, nullptr, c_locale) == v)
+            break;
+    }
+    if (prev_locale)
+        ::uselocale(prev_locale);
+    return len;
+}
+
+}
+
+/**
+ * encode value to the caller-provided buffer without heap
+ * allocations. Only numeric, boolean and character values are
+ * supported, other types should be encoded using
+ * valueEncode(QVariant const&)
+ *
+ * @param v value to be converted
+ * @param dst destination buffer, data is not zero-terminated
+ * @param size buffer size
+ *
+ * @return length of encoded data or -1 if value type is not
+ * supported or buffer is too small
+ */
+int valueEncode(QVariant const& v, char *dst, size_t size)
+{
+    switch(v.type()) {
+    case QVariant::Bool:
+        if (!size)
+            return -1;
+        dst[0] = v.toBool() ? '1' : '0';
+        return 1;
+    case QVariant::Char:
+    case QVariant::Int:
+    case QVariant::LongLong:
+        return formatInteger(v.toLongLong(), dst, size);
+    case QVariant::UInt:
+    case QVariant::ULongLong:
+        return formatInteger(v.toULongLong(), false, dst, size);
+    case QVariant::Double:
+        return formatDouble(v.toDouble(), dst, size);
+    default:
+        return -1;
+    }
 }
 
 /**
  * convert QVariant to QString, function reuses QVariant::toString()
  * but can process some types in a different way. E.g. boolean value
  * is encoded as 0/1 to be compatible with conventions used by sysfs
- * etc.
+ * etc., double is encoded using the shortest representation
  *
  * @param v value to be converted
  *
@@ -166,18 +758,118 @@ QVariant valueDecode(QString const& s)
  */
 QString valueEncode(QVariant const& v)
 {
-    switch(v.type()) {
-    case QVariant::Bool:
-        return v.toBool() ? "1" : "0";
-    case QVariant::Char:
-        return QString::number(v.toInt());
-    default:
-        return v.toString();
+    char buf[EncodedValue::max_inline_size];
+    auto len = valueEncode(v, buf, sizeof(buf));
+    return (len >= 0 ? QString::fromLatin1(buf, len) : v.toString());
+}
+
+/**
+ * encode value using valueEncode(), numeric values are kept in the
+ * internal buffer, heap is used only for strings, dates etc.
+ */
+EncodedValue::EncodedValue(QVariant const &v)
+    : data_(buf_)
+    , size_(valueEncode(v, buf_, sizeof(buf_)))
+{
+    if (size_ < 0) {
+        bytes_ = (v.userType() == blobType()
+                  ? v.value<Blob>().toByteArray()
+                  : v.toString().toUtf8());
+        data_ = bytes_.constData();
+        size_ = bytes_.size();
     }
 }
 
+Blob::Blob(QByteArray const &data)
+    : size_(0)
+{
+    append(data);
+}
+
+void Blob::append(QByteArray const &chunk)
+{
+    if (chunk.isEmpty())
+        return;
+    chunks_.push_back(chunk);
+    size_ += chunk.size();
+}
+
+/**
+ * @return all data as a single array, chunks are copied only if there
+ * are several of them
+ */
+QByteArray Blob::toByteArray() const
+{
+    if (chunks_.size() == 1)
+        return chunks_.front();
+
+    QByteArray res;
+    res.reserve(size_);
+    for (auto const &chunk : chunks_)
+        res.append(chunk);
+    return res;
+}
+
+/**
+ * blobs are equal if data is the same, chunks can be split
+ * differently
+ */
+bool Blob::operator ==(Blob const &other) const
+{
+    return size_ == other.size_ && !compare(other);
+}
+
+/**
+ * compare data lexicographically without joining chunks
+ *
+ * @return negative, zero or positive value like memcmp()
+ */
+int Blob::compare(Blob const &other) const
+{
+    int i = 0, j = 0, pos = 0, other_pos = 0;
+    while (i < chunks_.size() && j < other.chunks_.size()) {
+        auto const &a = chunks_[i];
+        auto const &b = other.chunks_[j];
+        auto len = std::min(a.size() - pos, b.size() - other_pos);
+        if (a.constData() + pos != b.constData() + other_pos) {
+            auto res = ::memcmp(a.constData() + pos
+                                , b.constData() + other_pos, len);
+            if (res)
+                return res;
+        }
+        pos += len;
+        other_pos += len;
+        if (pos == a.size()) {
+            ++i;
+            pos = 0;
+        }
+        if (other_pos == b.size()) {
+            ++j;
+            other_pos = 0;
+        }
+    }
+    return size_ - other.size_;
+}
+
+/**
+ * @return QVariant user type id to be used to declare blob properties
+ * (see setPropertyType()), blobs wrapped into QVariant can be compared
+ */
+int blobType()
+{
+    static const int id = [] {
+        auto res = qRegisterMetaType<Blob>();
+        QMetaType::registerComparators<Blob>();
+        return res;
+    }();
+    return id;
+}
+
 QVariant valueDefault(QVariant const& v)
 {
+    if (v.userType() == blobType())
+        return QVariant::fromValue(Blob());
+
     switch (v.type()) {
     case QVariant::String:
         return "";
@@ -196,13 +888,96 @@ QVariant valueDefault(QVariant const& v)
     }
 }
 
+namespace {
+
+class PropertyTypes
+{
+public:
+    static PropertyTypes &instance()
+    {
+        static PropertyTypes self;
+        return self;
+    }
+
+    void set(PropertyKey const &key, int type)
+    {
+        QWriteLocker lock(&lock_);
+        if (type != QVariant::Invalid)
+            types_[typeKey(key)] = type;
+        else
+            types_.remove(typeKey(key));
+    }
+
+    int get(PropertyKey const &key) const
+    {
+        QReadLocker lock(&lock_);
+        return types_.value(typeKey(key), QVariant::Invalid);
+    }
+
+private:
+    // the same property can be referenced using dot- or
+    // slash-separated name
+    static QString typeKey(PropertyKey const &key)
+    {
+        return key.ns() + "." + key.name();
+    }
+
+    mutable QReadWriteLock lock_;
+    QHash<QString, int> types_;
+};
+
+}
+
+/**
+ * declare property type, values of this property will be converted
+ * to the declared type instead of detecting the type using
+ * heuristics. Should be called before subscribing to the property.
+ *
+ * @param name full property name
+ * @param type property type (QVariant::Type or user type id like
+ * blobType()), QVariant::Invalid to remove declaration
+ */
+void setPropertyType(QString const &name, int type)
+{
+    PropertyKey key(name);
+    if (!key.isValid()) {
+        debug::warning("can't split '", name, "'");
+        return;
+    }
+    PropertyTypes::instance().set(key, type);
+}
+
+/**
+ * @return declared property type or QVariant::Invalid if type is not
+ * declared
+ */
+int getPropertyType(QString const &name)
+{
+    return getPropertyType(PropertyKey(name));
+}
+
+int getPropertyType(PropertyKey const &key)
+{
+    return (key.isValid()
+            ? PropertyTypes::instance().get(key)
+            : QVariant::Invalid);
+}
+
 static std::unique_ptr<QFile> fileFromName(const QString &name)
 {
     return std::unique_ptr<QFile>{new QFile(getPath(name))};
 }
 
-WriterImpl::WriterImpl(const QString &name)
+/// file is removed/replaced or statefs is restarted
+static bool isStaleFile(int fd)
+{
+    struct stat st;
+    return ::fstat(fd, &st) < 0 || !st.st_nlink;
+}
+
+WriterImpl::WriterImpl(const QString &name, WriteMode mode)
     : name_(name)
+    , mode_(mode)
     , file_(fileFromName(name))
 {
 }
@@ -223,20 +998,82 @@ QString const &WriterImpl::name() const
 
 FileErrorNs::FileError WriterImpl::set(const QVariant &v)
 {
-    auto s = valueEncode(v);
+    EncodedValue data(v);
+    return (mode_ == WriteMode::Persistent
+            ? setPersistent(data)
+            : setReopen(data));
+}
+
+FileErrorNs::FileError WriterImpl::setReopen(EncodedValue const &data)
+{
     if (!file_->open(QIODevice::WriteOnly))
         return file_->error();
 
-    QByteArray data{s.toUtf8().data()};
-    if (file_->write(data) != data.size())
+    if (file_->write(data.data(), data.size()) != data.size())
         return file_->error();
 
     file_->close();
     return FileErrorNs::NoError;
 }
 
+/**
+ * file is kept opened, value is written with pwrite() at offset 0
+ * and only if it differs from the last written one. File is reopened
+ * if it was replaced (so the same value is written to the new file)
+ * or once if writing is failed (e.g. statefs is restarted)
+ */
+FileErrorNs::FileError WriterImpl::setPersistent(EncodedValue const &data)
+{
+    if (file_->isOpen()) {
+        if (isStaleFile(file_->handle()))
+            file_->close();
+        else if (data == last_)
+            return FileErrorNs::NoError;
+    }
+
+    for (auto attempt = 0; attempt < 2; ++attempt) {
+        if (!file_->isOpen()) {
+            last_.clear();
+            if (!file_->open(QIODevice::WriteOnly | QIODevice::Unbuffered))
+                return file_->error();
+        }
+        auto fd = file_->handle();
+        auto len = ::pwrite(fd, data.constData(), data.size(), 0);
+        if (len == data.size()) {
+            // file is truncated only on open
+            if (data.size() < last_.size() && ::ftruncate(fd, data.size()))
+                debug::warning("Can't truncate", file_->fileName()
+                               , ::strerror(errno));
+            // buffer is reused, so there is no allocation if size of
+            // the value is not increased
+            last_.resize(data.size());
+            memcpy(last_.data(), data.data(), data.size());
+            return FileErrorNs::NoError;
+        }
+        debug::info("Reopening", file_->fileName(), "write failed:"
+                    , ::strerror(errno));
+        file_->close();
+    }
+    return FileErrorNs::WriteError;
+}
+
+/**
+ * @param name full property name
+ *
+ * File is reopened on each set()
+ */
 Writer::Writer(const QString &name)
-    : impl(new WriterImpl(name))
+    : impl(new WriterImpl(name, WriteMode::Reopen))
+{
+}
+
+/**
+ * @param name full property name
+ * @param mode WriteMode::Persistent to keep file opened and skip
+ * writing unchanged values
+ */
+Writer::Writer(const QString &name, WriteMode mode)
+    : impl(new WriterImpl(name, mode))
 {
 }
 
@@ -313,7 +1150,22 @@ FileErrorNs::FileError Writer::set(const QVariant &v)
  * slash-separated)
  */
 InOutWriter::InOutWriter(const QString &name)
-    : impl(new WriterImpl(QString("@") + name))
+    : impl(new WriterImpl(QString("@") + name, WriteMode::Reopen))
+{
+}
+
+/**
+ * Construct InOut property writer used to change corresponding
+ * output property
+ *
+ * @param name full output property name (dot- or
+ * slash-separated)
+ * @param mode WriteMode::Persistent to keep input property file
+ * opened and skip writing unchanged values, useful for frequently
+ * updated properties
+ */
+InOutWriter::InOutWriter(const QString &name, WriteMode mode)
+    : impl(new WriterImpl(QString("@") + name, mode))
 {
 }
 
@@ -10,15 +10,20 @@ namespace statefs { namespace qt {
 class WriterImpl
 {
 public:
-    WriterImpl(const QString&);
+    WriterImpl(const QString&, WriteMode);
     virtual ~WriterImpl();
 
     bool exists() const;
     QString const &name() const;
     FileErrorNs::FileError set(const QVariant&);
 private:
+    FileErrorNs::FileError setReopen(EncodedValue const &);
+    FileErrorNs::FileError setPersistent(EncodedValue const &);
+
     QString name_;
+    WriteMode mode_;
     std::unique_ptr<QFile> file_;
+    QByteArray last_;
 };
 
 }}
@@ -0,0 +1,839 @@
+#include "tests_common.hpp"
+#include <tut/tut.hpp>
+#include "property.hpp"
+#include <statefs/qt/snapshot.hpp>
+#include <contextproperty.h>
+#include <QTemporaryDir>
+#include <QDir>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QCoreApplication>
+#include <QMutex>
+#include <QThread>
+#include <QDebug>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <malloc.h>
+
+namespace {
+
+std::atomic<bool> is_counting_syscalls(false);
+std::atomic<size_t> syscalls_count(0);
+
+size_t raiseFdLimit()
+{
+    rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit))
+        return 0;
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+size_t heapUsed()
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    return ::mallinfo2().uordblks;
+#else
+    return ::mallinfo().uordblks;
+#endif
+}
+
+inline void countSyscall()
+{
+    if (is_counting_syscalls)
+        ++syscalls_count;
+}
+
+template <typename T>
+T nextFn(char const *name)
+{
+    return reinterpret_cast<T>(::dlsym(RTLD_NEXT, name));
+}
+
+}
+
+// count file-related system calls made through libc
+#define COUNTED_CALL(name, ret_type, params, args)                     \
+    COUNTED_CALL_SPEC(name, ret_type, params, args, )
+
+// some functions are declared by libc as non-throwing
+#define COUNTED_CALL_NOTHROW(name, ret_type, params, args)             \
+    COUNTED_CALL_SPEC(name, ret_type, params, args, noexcept)
+
+#define COUNTED_CALL_SPEC(name, ret_type, params, args, spec)          \
+    ret_type name params spec                                           \
+    {                                                                   \
+        typedef ret_type (*fn_type) params;                             \
+        static auto fn = nextFn<fn_type>(#name);                        \
+        countSyscall();                                                 \
+        return fn args;                                                 \
+    }
+
+#define COUNTED_OPEN(name, params, args)                                \
+    int name params                                                     \
+    {                                                                   \
+        typedef int (*fn_type) params;                                  \
+        static auto fn = nextFn<fn_type>(#name);                        \
+        mode_t mode = 0;                                                \
+        if (flags & O_CREAT) {                                          \
+            va_list ap;                                                 \
+            va_start(ap, flags);                                        \
+            mode = va_arg(ap, mode_t);                                  \
+            va_end(ap);                                                 \
+        }                                                               \
+        countSyscall();                                                 \
+        return fn args;                                                 \
+    }
+
+extern "C" {
+
+COUNTED_CALL(read, ssize_t, (int fd, void *buf, size_t n), (fd, buf, n))
+COUNTED_CALL(pread, ssize_t, (int fd, void *buf, size_t n, off_t off)
+             , (fd, buf, n, off))
+COUNTED_CALL(pread64, ssize_t, (int fd, void *buf, size_t n, off64_t off)
+             , (fd, buf, n, off))
+COUNTED_CALL(close, int, (int fd), (fd))
+COUNTED_CALL_NOTHROW(lseek, off_t, (int fd, off_t off, int whence)
+                     , (fd, off, whence))
+COUNTED_CALL_NOTHROW(lseek64, off64_t, (int fd, off64_t off, int whence)
+                     , (fd, off, whence))
+COUNTED_OPEN(open, (char const *path, int flags, ...), (path, flags, mode))
+COUNTED_OPEN(open64, (char const *path, int flags, ...), (path, flags, mode))
+COUNTED_OPEN(openat, (int dir, char const *path, int flags, ...)
+             , (dir, path, flags, mode))
+COUNTED_OPEN(openat64, (int dir, char const *path, int flags, ...)
+             , (dir, path, flags, mode))
+
+}
+
+namespace tut
+{
+
+struct property_test
+{
+    property_test()
+    {
+        // NamespaceDirs reads location of the session statefs root
+        // only once, it should point to the test directory
+        if (!root_.isValid())
+            return;
+        ::setenv("XDG_RUNTIME_DIR", QFile::encodeName(root_.path()), 1);
+        QDir(root_.path()).mkpath("state/namespaces/Test");
+    }
+
+    virtual ~property_test()
+    {
+    }
+
+    static bool setValue(QString const &v, QString const &name = "Value")
+    {
+        QFile f(root_.path() + "/state/namespaces/Test/" + name);
+        if (!f.open(QIODevice::WriteOnly))
+            return false;
+        return f.write(v.toUtf8()) >= 0;
+    }
+
+    static QTemporaryDir root_;
+};
+
+QTemporaryDir property_test::root_;
+
+typedef test_group<property_test> tf;
+typedef tf::object object;
+tf vault_property_test("property");
+
+enum test_ids {
+    tid_update_syscalls =  1,
+    tid_batch_update,
+    tid_wait_for_file,
+    tid_read_arena,
+    tid_blob,
+    tid_snapshot,
+    tid_shards,
+    tid_cache_readers,
+    tid_cache_generation,
+    tid_fanout,
+    tid_dispatch_burst,
+    tid_rate_limit,
+    tid_dispatcher_thread_exit,
+    tid_persistent_writer
+};
+
+template<> template<>
+void object::test<tid_update_syscalls>()
+{
+    using statefs::qt::Property;
+    using statefs::qt::Key;
+
+    static const size_t updates_count = 10000;
+#ifdef STATEFS_QT_TOUCH_WORKAROUND
+    // file is opened and closed before each read
+    static const size_t max_syscalls_per_update = 4;
+#else
+    static const size_t max_syscalls_per_update = 2;
+#endif
+
+    ensure("Temporary dir", root_.isValid());
+    ensure("Initial value", setValue("42"));
+
+    Property p(Key("Test.Value"), nullptr);
+    ensure("First update", p.update());
+    ensure("Same value", !p.update());
+    ensure("Set value", setValue("43"));
+    ensure("Value is changed", p.update());
+
+    QElapsedTimer timer;
+    syscalls_count = 0;
+    is_counting_syscalls = true;
+    timer.start();
+    for (size_t i = 0; i < updates_count; ++i)
+        p.update();
+    auto elapsed = timer.nsecsElapsed();
+    is_counting_syscalls = false;
+
+    qDebug() << "Update: syscalls" << double(syscalls_count) / updates_count
+             << ", ns" << double(elapsed) / updates_count;
+    ensure("Syscalls per update"
+           , syscalls_count <= updates_count * max_syscalls_per_update);
+
+    // value is bigger than the initial buffer
+    ensure("Set big value", setValue(QString(1000, 'x')));
+    ensure("Big value is changed", p.update());
+    auto unchanged = statefs::qt::monitorStats().unchanged;
+    ensure("Big value is not changed", !p.update());
+    ensure_equals("Big value is not decoded"
+                  , statefs::qt::monitorStats().unchanged - unchanged, 1u);
+    ensure("Set big value of the same size"
+           , setValue(QString(999, 'x') + "y"));
+    ensure("Big value of the same size is changed", p.update());
+}
+
+template<> template<>
+void object::test<tid_batch_update>()
+{
+    using statefs::qt::Property;
+    using statefs::qt::PropertyKey;
+    using statefs::qt::BatchReader;
+
+    static const size_t reads_count = 100000;
+
+    ensure("Temporary dir", root_.isValid());
+
+    auto fd_limit = raiseFdLimit();
+
+    BatchReader reader;
+    qDebug() << "io_uring is used:" << reader.isBatching();
+
+    for (size_t count : {100, 1000, 10000}) {
+        if (count + 64 > fd_limit) {
+            qDebug() << "Skipping" << count << "properties, fd limit is"
+                     << fd_limit;
+            continue;
+        }
+        std::vector<std::unique_ptr<Property> > props;
+        std::vector<Property*> ptrs;
+        for (size_t i = 0; i < count; ++i) {
+            auto name = QString("P%1").arg(i);
+            ensure("Set value", setValue(QString::number(i), name));
+            props.emplace_back(new Property(PropertyKey("Test." + name)
+                                            , nullptr));
+            ensure("First update", props.back()->update());
+            ptrs.push_back(props.back().get());
+        }
+
+        auto rounds = std::max<size_t>(reads_count / count, 3);
+        QElapsedTimer timer;
+        timer.start();
+        for (size_t r = 0; r < rounds; ++r) {
+            for (auto p : ptrs)
+                p->update();
+        }
+        auto single_ns = timer.nsecsElapsed();
+
+        auto before = statefs::qt::monitorStats().updates;
+        timer.restart();
+        for (size_t r = 0; r < rounds; ++r)
+            reader.update(ptrs.data(), ptrs.size());
+        auto batch_ns = timer.nsecsElapsed();
+        ensure_equals("All properties are updated"
+                      , statefs::qt::monitorStats().updates - before
+                      , rounds * count);
+
+        auto per_second = [rounds, count](qint64 ns) {
+            return double(rounds * count) * 1e9 / ns;
+        };
+        qDebug() << count << "properties, notifications/s: per-fd"
+                 << per_second(single_ns) << ", batch" << per_second(batch_ns);
+    }
+}
+
+template<> template<>
+void object::test<tid_wait_for_file>()
+{
+    using statefs::qt::Property;
+    using statefs::qt::DirWatcher;
+    using statefs::qt::Key;
+
+    ensure("Temporary dir", root_.isValid());
+
+    DirWatcher watcher;
+    Property p(Key("Late.Value"), nullptr, nullptr, &watcher);
+    ensure("No value yet", p.subscribe().isNull());
+
+    // namespace directory and property file appear after subscription,
+    // file is renamed into place to have data in it
+    QDir ns_dir(root_.path() + "/state/namespaces/Late");
+    ensure("Create namespace", ns_dir.mkpath("."));
+    {
+        QFile f(ns_dir.filePath(".Value.tmp"));
+        ensure("Create file", f.open(QIODevice::WriteOnly));
+        ensure("Write file", f.write("7") == 1);
+    }
+    ensure("Rename file", QFile::rename(ns_dir.filePath(".Value.tmp")
+                                        , ns_dir.filePath("Value")));
+
+    QElapsedTimer timer;
+    timer.start();
+    QVariant v;
+    while (timer.elapsed() < 2000) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+        v = p.subscribe();
+        if (!v.isNull())
+            break;
+    }
+    qDebug() << "Value appeared in" << timer.elapsed() << "ms";
+    ensure_equals("Value is read after file appeared", v.toInt(), 7);
+}
+
+template<> template<>
+void object::test<tid_read_arena>()
+{
+    using statefs::qt::Property;
+    using statefs::qt::PropertyKey;
+    using statefs::qt::ReadArena;
+
+    static const size_t count = 5000;
+    static const int value_size = 200;
+
+    ensure("Temporary dir", root_.isValid());
+    if (count + 64 > raiseFdLimit()) {
+        qDebug() << "Skipping, fd limit is too low";
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        auto value = QString(value_size, QChar('a' + i % 26));
+        ensure("Set value", setValue(value, QString("M%1").arg(i)));
+    }
+
+    // arena could be grown by previous tests
+    statefs::qt::setReadBufferLimit(512);
+
+    // memory used by subscriptions after the first read
+    std::vector<std::unique_ptr<Property> > props;
+    props.reserve(count);
+    auto before = heapUsed();
+    for (size_t i = 0; i < count; ++i) {
+        props.emplace_back(new Property(PropertyKey(QString("Test.M%1").arg(i))
+                                        , nullptr));
+        ensure("Read", props.back()->update());
+    }
+    auto used = heapUsed() - before;
+    auto &arena = ReadArena::instance();
+    qDebug() << "Heap per subscription:" << double(used) / count
+             << "bytes, arena" << arena.capacity();
+    ensure("Arena fits one value", arena.capacity() >= value_size + 1);
+    ensure("Arena is shared", arena.capacity() <= 512);
+    // idle properties do not keep read buffers, the single arena block
+    // is much smaller than a buffer per property
+    ensure("Arena is smaller than buffers of properties"
+           , arena.capacity() * 100 <= count * (value_size + 1));
+
+    // arena is reused by the next reads, so repeated updates do not
+    // grow the heap
+    before = heapUsed();
+    for (int r = 0; r < 3; ++r) {
+        for (auto &p : props)
+            p->update();
+    }
+    auto after = heapUsed();
+    auto grown = (after > before ? after - before : 0);
+    qDebug() << "Heap grown by" << count * 3 << "reads:" << grown;
+    ensure("Repeated reads do not grow heap", grown < 4096);
+    ensure("Arena is not grown", arena.capacity() <= 512);
+
+    // big values are read into temporary blocks if arena is limited
+    statefs::qt::setReadBufferLimit(1024);
+    ensure("Set big value", setValue(QString(100000, 'x'), "M0"));
+    ensure("Big value is read", props[0]->update());
+    ensure("Arena is limited", arena.capacity() <= 1024);
+    statefs::qt::setReadBufferLimit(0);
+}
+
+template<> template<>
+void object::test<tid_blob>()
+{
+    using statefs::qt::Property;
+    using statefs::qt::Key;
+    using statefs::qt::Blob;
+
+    ensure("Temporary dir", root_.isValid());
+
+    // bigger than one chunk
+    auto data = QString(200000, 'j');
+    ensure("Set value", setValue(data, "Blob"));
+    statefs::qt::setPropertyType("Test.Blob", statefs::qt::blobType());
+
+    Property p(Key("Test.Blob"), nullptr);
+    QElapsedTimer timer;
+    timer.start();
+    ensure("Read", p.update());
+    qDebug() << "Blob read in" << timer.nsecsElapsed() << "ns";
+
+    auto blob = p.subscribe().value<Blob>();
+    ensure_equals("Size", blob.size(), data.size());
+    ensure("Chunked", blob.chunks().size() > 1);
+    ensure("Data", blob.toByteArray() == data.toUtf8());
+    ensure("Not changed", !p.update());
+
+    ensure("Set short value", setValue("{}", "Blob"));
+    ensure("Changed", p.update());
+    ensure("Short value", p.subscribe().value<Blob>()
+           == Blob(QByteArray("{}")));
+}
+
+template<> template<>
+void object::test<tid_snapshot>()
+{
+    using statefs::qt::Snapshot;
+
+    static const int count = 300;
+
+    ensure("Temporary dir", root_.isValid());
+    QDir ns_dir(root_.path() + "/state/namespaces/Snap");
+    ensure("Create namespace", ns_dir.mkpath("."));
+    for (int i = 0; i < count; ++i) {
+        QFile f(ns_dir.filePath(QString("P%1").arg(i)));
+        ensure("Create file", f.open(QIODevice::WriteOnly));
+        ensure("Write", f.write(QByteArray::number(i)) >= 0);
+    }
+    {
+        QFile f(ns_dir.filePath("Empty"));
+        ensure("Create empty", f.open(QIODevice::WriteOnly));
+    }
+    {
+        // bigger than max file size, truncated value is not returned
+        QFile f(ns_dir.filePath("Huge"));
+        ensure("Create huge", f.open(QIODevice::WriteOnly));
+        ensure("Write huge", f.write(QByteArray(2 * 1024 * 1024, 'x')) > 0);
+    }
+
+    auto snapshot = Snapshot::read("Snap");
+    auto const &stats = snapshot.stats();
+    qDebug() << "Snapshot of" << stats.count << "properties: list"
+             << stats.list_ns << "ns, read" << stats.read_ns << "ns by"
+             << stats.threads << "threads";
+    ensure_equals("Count", stats.count, count + 1);
+    ensure_equals("Failed", stats.failed, 1);
+    ensure("Huge value is not read", !snapshot.value("Snap.Huge").isValid());
+    for (int i = 0; i < count; ++i) {
+        auto v = snapshot.value(QString("Snap.P%1").arg(i));
+        ensure_equals("Value", v.toInt(), i);
+    }
+    ensure("Empty value", snapshot.value("Snap.Empty").toString().isEmpty());
+    ensure("No namespace", Snapshot::read("NoSuchNamespace").isEmpty());
+}
+
+template<> template<>
+void object::test<tid_shards>()
+{
+    using statefs::qt::PropertyMonitor;
+    using statefs::qt::PropertyKey;
+
+    static const int flood_count = 20;
+
+    ensure("Temporary dir", root_.isValid());
+    statefs::qt::setMonitorThreads(4);
+    ensure_equals("Shards", PropertyMonitor::shardsCount(), size_t(4));
+
+    auto shard = [](QString const &key) {
+        return PropertyMonitor::shard(PropertyKey(key));
+    };
+    ensure_equals("Namespace is in one shard", shard("Flood.A"), shard("Flood.B"));
+
+    // namespaces in the same and in the other shard
+    QString same, other;
+    for (int i = 0; i < 100 && (same.isEmpty() || other.isEmpty()); ++i) {
+        auto ns = QString("Quiet%1").arg(i);
+        auto &dst = (shard(ns + ".A") == shard("Flood.A") ? same : other);
+        if (dst.isEmpty())
+            dst = ns;
+    }
+    ensure("Namespaces are distributed", !same.isEmpty() && !other.isEmpty());
+
+    auto mkprop = [](QString const &ns, QString const &name) {
+        QDir dir(root_.path() + "/state/namespaces/" + ns);
+        QFile f(dir.filePath(name));
+        return dir.mkpath(".") && f.open(QIODevice::WriteOnly)
+            && f.write("1") == 1;
+    };
+
+    // regular files are always readable, so properties in Flood
+    // namespace keep its monitor thread busy
+    std::vector<std::unique_ptr<ContextProperty> > flood;
+    for (int i = 0; i < flood_count; ++i) {
+        auto name = QString("P%1").arg(i);
+        ensure("Flood property", mkprop("Flood", name));
+        flood.emplace_back(new ContextProperty("Flood." + name));
+    }
+
+    auto latency = [&mkprop](QString const &ns) {
+        ensure("Property", mkprop(ns, "Value"));
+        QElapsedTimer timer;
+        timer.start();
+        ContextProperty p(ns + ".Value");
+        p.waitForSubscription(true);
+        auto res = timer.nsecsElapsed();
+        ensure_equals("Value " + ns.toStdString(), p.value().toInt(), 1);
+        return res;
+    };
+    auto same_ns = latency(same);
+    auto other_ns = latency(other);
+    qDebug() << "Subscription latency while flooding: same shard"
+             << same_ns << "ns, other shard" << other_ns << "ns";
+}
+
+namespace {
+
+// previous implementation of the cache, used as the baseline
+class MutexCache
+{
+public:
+    void store(QVariant v)
+    {
+        QMutexLocker lock(&mutex_);
+        data_ = v;
+    }
+
+    QVariant load() const
+    {
+        QMutexLocker lock(&mutex_);
+        return data_;
+    }
+private:
+    mutable QMutex mutex_;
+    QVariant data_;
+};
+
+/// @return loads per second per reader while the value is updated
+template <typename CacheT>
+double cacheLoadRate(int readers_count, int duration_ms)
+{
+    CacheT cache;
+    std::atomic<bool> is_running(true);
+    std::atomic<bool> is_valid(true);
+    std::atomic<quint64> loads(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < readers_count; ++i) {
+        readers.emplace_back([&]() {
+                quint64 count = 0;
+                while (is_running.load(std::memory_order_relaxed)) {
+                    auto v = cache.load();
+                    bool ok = true;
+                    if (v.isValid())
+                        v.toString().toInt(&ok);
+                    if (!ok)
+                        is_valid = false;
+                    ++count;
+                }
+                loads += count;
+            });
+    }
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; timer.elapsed() < duration_ms; ++i)
+        cache.store(QString::number(i));
+    is_running = false;
+    for (auto &t : readers)
+        t.join();
+    auto elapsed = timer.nsecsElapsed();
+    ensure("Loaded values are consistent", is_valid.load());
+    return double(loads) * 1000000000 / elapsed / readers_count;
+}
+
+}
+
+template<> template<>
+void object::test<tid_cache_readers>()
+{
+    using statefs::qt::Cache;
+
+    for (int readers : {1, 2, 4, 8}) {
+        auto rate = cacheLoadRate<Cache>(readers, 200);
+        auto mutex_rate = cacheLoadRate<MutexCache>(readers, 200);
+        qDebug() << "Cache loads per reader/s," << readers << "readers:"
+                 << rate << "(mutex:" << mutex_rate << ")";
+    }
+}
+
+template<> template<>
+void object::test<tid_cache_generation>()
+{
+    using statefs::qt::Cache;
+
+    Cache c1, c2;
+    quint64 gen = 1;
+    ensure("Initial value", !c1.load(gen).isValid());
+    ensure_equals("Initial generation", gen, 0u);
+    ensure_equals("Empty cache", c1.generation(), 0u);
+
+    c1.store(1);
+    auto gen1 = c1.generation();
+    ensure("Generation after store", gen1 > 0);
+    ensure_equals("Value", c1.load(gen).toInt(), 1);
+    ensure_equals("Value generation", gen, gen1);
+
+    // generations are unique in the process
+    c2.store(1);
+    ensure("Other cache generation", c2.generation() > gen1);
+    c1.store(2);
+    ensure("Next generation", c1.generation() > c2.generation());
+    ensure_equals("Next value", c1.load(gen).toInt(), 2);
+    ensure_equals("Next value generation", gen, c1.generation());
+}
+
+namespace {
+
+class UserEventsCounter : public QObject
+{
+public:
+    UserEventsCounter() : count(0)
+    {
+        QCoreApplication::instance()->installEventFilter(this);
+    }
+
+    ~UserEventsCounter()
+    {
+        QCoreApplication::instance()->removeEventFilter(this);
+    }
+
+    bool eventFilter(QObject *, QEvent *e)
+    {
+        if (e->type() >= QEvent::User)
+            ++count;
+        return false;
+    }
+
+    int count;
+};
+
+}
+
+template<> template<>
+void object::test<tid_fanout>()
+{
+    static const int count = 200;
+
+    ensure("Temporary dir", root_.isValid());
+    ensure("Initial value", setValue("1", "Fanout"));
+
+    std::vector<std::unique_ptr<ContextProperty> > props;
+    int changes = 0;
+    for (int i = 0; i < count; ++i) {
+        props.emplace_back(new ContextProperty("Test.Fanout"));
+        QObject::connect(props.back().get(), &ContextProperty::valueChanged
+                         , [&changes]() { ++changes; });
+    }
+    for (auto &p : props)
+        p->waitForSubscription(true);
+    QCoreApplication::processEvents();
+
+    // all subscribers are in the same thread, so one change should
+    // be delivered using one event
+    UserEventsCounter events;
+    changes = 0;
+    ensure("Changed value", setValue("2", "Fanout"));
+    QElapsedTimer timer;
+    timer.start();
+    while (changes < count && timer.elapsed() < 5000)
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+    ensure_equals("All subscribers are notified", changes, count);
+    ensure_equals("Value", props.back()->value().toInt(), 2);
+    qDebug() << "Events to notify" << count << "subscribers:" << events.count;
+    ensure("Events per change do not depend on subscribers count"
+           , events.count < count / 10);
+}
+
+template<> template<>
+void object::test<tid_dispatch_burst>()
+{
+    static const int count = 200;
+
+    ensure("Temporary dir", root_.isValid());
+    std::vector<std::unique_ptr<ContextProperty> > props;
+    int changes = 0;
+    for (int i = 0; i < count; ++i) {
+        auto name = QString("Burst%1").arg(i);
+        ensure("Initial value", setValue("1", name));
+        props.emplace_back(new ContextProperty("Test." + name));
+        QObject::connect(props.back().get(), &ContextProperty::valueChanged
+                         , [&changes]() { ++changes; });
+    }
+    for (auto &p : props) {
+        p->waitForSubscription(true);
+        // value is received together with its generation, so it is
+        // not loaded again from the cache
+        ensure("Subscribed value generation", p->generation() != 0);
+    }
+    QCoreApplication::processEvents();
+
+    // changes of different keys are collected by the thread
+    // dispatcher, it is woken up once per event loop iteration
+    UserEventsCounter events;
+    changes = 0;
+    auto before = statefs::qt::monitorStats().updates;
+    for (int i = 0; i < count; ++i)
+        ensure("Changed value", setValue("2", QString("Burst%1").arg(i)));
+    // all changes are read by the monitor before the event loop is
+    // entered, so they are posted to the not yet woken up dispatcher
+    QElapsedTimer timer;
+    timer.start();
+    while (statefs::qt::monitorStats().updates - before < (quint64)count
+           && timer.elapsed() < 5000)
+        QThread::msleep(1);
+    QThread::msleep(50);
+    timer.restart();
+    while (changes < count && timer.elapsed() < 5000)
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+    ensure_equals("All subscribers are notified", changes, count);
+    qDebug() << "Events to notify about" << count << "changes:" << events.count;
+    // the last change can be posted while the first batch is
+    // dispatched
+    ensure("Changes are coalesced", events.count <= 2);
+}
+
+template<> template<>
+void object::test<tid_rate_limit>()
+{
+    static const int updates_count = 20;
+    static const int update_interval = 10;
+
+    ensure("Temporary dir", root_.isValid());
+
+    // value is changed each 10ms, returns number of notifications
+    auto run = [](QString const &name, int interval, int debounce) {
+        ensure("Initial value", setValue("0", name));
+        ContextProperty p("Test." + name);
+        p.setRateLimit(interval, debounce);
+        p.waitForSubscription(true);
+        QCoreApplication::processEvents();
+
+        int changes = 0;
+        QObject::connect(&p, &ContextProperty::valueChanged
+                         , [&changes]() { ++changes; });
+        for (int i = 1; i <= updates_count; ++i) {
+            ensure("Changed value", setValue(QString::number(i), name));
+            QElapsedTimer timer;
+            timer.start();
+            while (timer.elapsed() < update_interval)
+                QCoreApplication::processEvents(QEventLoop::AllEvents
+                                                , update_interval);
+        }
+        // the latest value is delivered when the window is closed
+        QElapsedTimer timer;
+        timer.start();
+        while (p.value().toInt() != updates_count && timer.elapsed() < 5000)
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+        ensure_equals("Latest value " + name.toStdString()
+                      , p.value().toInt(), updates_count);
+        return changes;
+    };
+
+    auto limited = run("Limited", 100, 0);
+    auto debounced = run("Debounced", 0, 100);
+    qDebug() << updates_count << "changes, notified: interval 100ms"
+             << limited << ", debounce 100ms" << debounced;
+    ensure("Interval limits notifications", limited <= 5);
+    ensure("Debounce limits notifications", debounced <= 2);
+}
+
+template<> template<>
+void object::test<tid_dispatcher_thread_exit>()
+{
+    ensure("Temporary dir", root_.isValid());
+    ensure("Initial value", setValue("1", "ThreadExit"));
+
+    // unsubscription is asynchronous, so the monitor still holds
+    // subscriber of the finished thread
+    std::thread([]() {
+            ContextProperty p("Test.ThreadExit");
+            p.waitForSubscription(true);
+        }).join();
+
+    ContextProperty p("Test.ThreadExit");
+    p.waitForSubscription(true);
+    int changes = 0;
+    QObject::connect(&p, &ContextProperty::valueChanged
+                     , [&changes]() { ++changes; });
+    for (int i = 2; i < 10; ++i) {
+        ensure("Changed value", setValue(QString::number(i), "ThreadExit"));
+        QElapsedTimer timer;
+        timer.start();
+        while (p.value().toInt() != i && timer.elapsed() < 5000)
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+        ensure_equals("Value", p.value().toInt(), i);
+    }
+    ensure("Notified", changes > 0);
+}
+
+template<> template<>
+void object::test<tid_persistent_writer>()
+{
+    using statefs::qt::Writer;
+    using statefs::qt::WriteMode;
+    using statefs::qt::FileErrorNs;
+
+    ensure("Temporary dir", root_.isValid());
+    auto path = root_.path() + "/state/namespaces/Test/Written";
+    auto read = [&path]() {
+        QFile f(path);
+        return f.open(QIODevice::ReadOnly) ? f.readAll() : QByteArray();
+    };
+    ensure("Initial value", setValue("", "Written"));
+
+    Writer writer("Test.Written", WriteMode::Persistent);
+    for (int i = 0; i < 100; ++i) {
+        ensure("Repeated write", writer.set(i) == FileErrorNs::NoError);
+        ensure("Value is written", read() == QByteArray::number(i));
+    }
+    ensure("Shorter value", writer.set("x") == FileErrorNs::NoError);
+    ensure("File is truncated", read() == "x");
+    ensure("Same value", writer.set("x") == FileErrorNs::NoError);
+    ensure("Same value is kept", read() == "x");
+
+    // unchanged value is skipped only while the file is not replaced
+    ensure("Removed", QFile::remove(path));
+    ensure("Recreated", setValue("y", "Written"));
+    ensure("Same value to recreated", writer.set("x") == FileErrorNs::NoError);
+    ensure("Recreated file is written", read() == "x");
+
+    ensure("New file", setValue("z", "Written.new"));
+    ensure("Renamed", ::rename(QFile::encodeName(path + ".new").constData()
+                               , QFile::encodeName(path).constData()) == 0);
+    ensure("Same value to replaced", writer.set("x") == FileErrorNs::NoError);
+    ensure("Replaced file is written", read() == "x");
+}
+
+}
@@ -1,9 +1,15 @@
 #include "tests_common.hpp"
 #include <tut/tut.hpp>
 #include <contextproperty.h>
+#include <statefs/qt/client.hpp>
 #include <QDebug>
 #include <QCoreApplication>
+#include <QElapsedTimer>
 #include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <malloc.h>
 
 namespace tut
 {
@@ -20,7 +26,10 @@ typedef tf::object object;
 tf vault_subscriber_test("subscriber");
 
 enum test_ids {
-    tid_race_condition =  1
+    tid_race_condition =  1,
+    tid_churn,
+    tid_subscribe_many,
+    tid_no_monitor_entry
 };
 
 static QString property1Name("Unknown.NonExistent");
@@ -61,4 +70,131 @@ void object::test<tid_race_condition>()
     execute_in_event_loop(test_events_fn);
 }
 
+template<> template<>
+void object::test<tid_churn>()
+{
+    // subscription churn: requests to the monitor are posted from
+    // several client threads as fast as possible
+    static const int threads_count = 4;
+    static const int count = 5000;
+    static const int batch = 100;
+
+    auto targets = []() { return statefs::qt::monitorStats().targets; };
+    // requests for the same key are processed in order by the same
+    // monitor thread, so all requests posted before are applied when
+    // subscription is finished
+    auto flush = [](ContextProperty &p) {
+        p.unsubscribe();
+        p.subscribe();
+        p.waitForSubscription(true);
+    };
+    ContextProperty other(property1Name);
+    ContextProperty last(property2Name);
+    flush(other);
+    flush(last);
+    auto before = targets();
+
+    // properties of the last batch of each thread are kept subscribed
+    std::vector<std::vector<std::unique_ptr<ContextProperty> > > kept
+        (threads_count);
+    std::vector<std::thread> producers;
+    QElapsedTimer timer;
+    timer.start();
+    for (int t = 0; t < threads_count; ++t) {
+        producers.emplace_back([&kept, t]() {
+                for (int i = 0; i < count; i += batch) {
+                    std::vector<std::unique_ptr<ContextProperty> > props;
+                    for (int j = 0; j < batch; ++j)
+                        props.emplace_back(new ContextProperty(property2Name));
+                    for (auto &p : props) {
+                        p->unsubscribe();
+                        p->subscribe();
+                    }
+                    if (i + batch >= count)
+                        kept[t] = std::move(props);
+                }
+            });
+    }
+    for (auto &producer : producers)
+        producer.join();
+    auto elapsed = timer.nsecsElapsed();
+    // each iteration: subscribe, unsubscribe, subscribe, unsubscribe
+    qDebug() << "Churn:" << double(elapsed) / (threads_count * count * 4)
+             << "ns per request";
+
+    flush(last);
+    ensure_equals("Kept properties are subscribed", targets() - before
+                  , quint64(threads_count * batch));
+
+    kept.clear();
+    flush(last);
+    ensure_equals("Released properties are unsubscribed", targets(), before);
+}
+
+template<> template<>
+void object::test<tid_subscribe_many>()
+{
+    // application start: a lot of properties are subscribed at once
+    // and nobody is waiting for subscription to be finished
+    static const int count = 10000;
+    // std::promise/std::future shared state allocated for each
+    // request before: mutex, condition variable and result
+    static const qint64 promise_heap_size = 128;
+
+    auto heap_used = []() {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+        return (qint64)::mallinfo2().uordblks;
+#else
+        return (qint64)::mallinfo().uordblks;
+#endif
+    };
+
+    std::vector<std::unique_ptr<ContextProperty> > props;
+    props.reserve(count);
+    for (int i = 0; i < count; ++i)
+        props.emplace_back(new ContextProperty(property2Name));
+    // constructor subscribes, so properties are unsubscribed to
+    // measure subscription requests. Requests for the same key are
+    // processed in order, so all properties are unsubscribed when the
+    // last one is subscribed again
+    for (auto &p : props)
+        p->unsubscribe();
+    props.back()->subscribe();
+    props.back()->waitForSubscription(true);
+    idle_event_loop();
+
+    auto requests = count - 1;
+    auto before = heap_used();
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < requests; ++i)
+        props[i]->subscribe();
+    auto elapsed = timer.nsecsElapsed();
+    auto used = heap_used() - before;
+    qDebug() << "Subscribe:" << double(elapsed) / requests << "ns,"
+             << double(used) / requests << "bytes per request in flight";
+    ensure("Request is cheaper than promise/future"
+           , used / requests < promise_heap_size);
+
+    props[requests - 1]->waitForSubscription(true);
+    idle_event_loop();
+}
+
+template<> template<>
+void object::test<tid_no_monitor_entry>()
+{
+    // monitor does not create an entry for the empty key, so the
+    // property is destroyed while nobody else holds its handle
+    for (int i = 0; i < 100; ++i) {
+        auto p = new ContextProperty("");
+        idle_event_loop();
+        delete p;
+    }
+    // requests for the same key are processed by the same monitor
+    // thread, so it is alive if subscription is finished
+    ContextProperty p("");
+    p.waitForSubscription(true);
+    idle_event_loop();
+}
+
 }
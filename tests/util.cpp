@@ -0,0 +1,459 @@
+#include "tests_common.hpp"
+#include <tut/tut.hpp>
+#include "property.hpp"
+#include <statefs/qt/util.hpp>
+#include <QRegExp>
+#include <QVariant>
+#include <QDateTime>
+#include <QTemporaryDir>
+#include <QDir>
+#include <QFile>
+#include <QCoreApplication>
+#include <contextproperty.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+std::atomic<bool> is_counting_allocations(false);
+std::atomic<size_t> allocations_count(0);
+
+}
+
+// count heap allocations (Qt containers are using malloc directly)
+extern "C" {
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size)
+{
+    if (is_counting_allocations)
+        ++allocations_count;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (is_counting_allocations)
+        ++allocations_count;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    if (is_counting_allocations)
+        ++allocations_count;
+    return __libc_realloc(p, size);
+}
+
+}
+
+namespace tut
+{
+
+struct util_test
+{
+    util_test()
+    {
+        // property directories are resolved only once, location of
+        // the session statefs root should point to the test directory
+        if (!root_.isValid())
+            return;
+        ::setenv("XDG_RUNTIME_DIR", QFile::encodeName(root_.path()), 1);
+        QDir(root_.path()).mkpath("state/namespaces/Test");
+    }
+
+    virtual ~util_test()
+    {
+    }
+
+    static QString path(QString const &name)
+    {
+        return root_.path() + "/state/namespaces/Test/" + name;
+    }
+
+    static bool setValue(QString const &name, QByteArray const &v)
+    {
+        QFile f(path(name));
+        return f.open(QIODevice::WriteOnly) && f.write(v) == v.size();
+    }
+
+    static QTemporaryDir root_;
+};
+
+QTemporaryDir util_test::root_;
+
+typedef test_group<util_test> tf;
+typedef tf::object object;
+tf vault_util_test("util");
+
+enum test_ids {
+    tid_decode_vs_regex =  1,
+    tid_key_split,
+    tid_declared_type,
+    tid_decode_raw,
+    tid_encode,
+    tid_blob,
+    tid_update_allocations,
+    tid_delivery_allocations
+};
+
+namespace {
+
+// reference implementation: regular expressions table used by
+// valueDecode() before it was replaced with the single pass scanner
+QRegExp re(QString const &cs)
+{
+    static const QString aspaces = "\\s*";
+    return QRegExp(aspaces + cs + aspaces, Qt::CaseSensitive, QRegExp::RegExp2);
+}
+
+QVariant regexDecode(QString const &s)
+{
+    static const QString date_re("[0-9]{4}-[0-9]{2}-[0-9]{2}");
+    static const QString hhmm_re("[0-9]{2}:[0-9]{2}");
+    static const QString time_re(QString("%1(:[0-9]{2})?").arg(hhmm_re));
+    static const QString tz_re("(Z|[+-][0-9]{2}(:[0-9]{2})?)");
+    static const QString datetime_re(QString("%1T%2%3")
+                                     .arg(date_re, time_re, tz_re));
+    static const std::vector<std::pair<QRegExp, QVariant::Type> > re_types
+        = {{re("[+-][0-9]+"), QVariant::Int}
+           , {re("[0-9]{11,}"), QVariant::String}
+           , {re("[0-9]+"), QVariant::UInt}
+           , {re("[+-]?([0-9]+\\.[0-9]*|[0-9]*\\.[0-9]+)"), QVariant::Double}
+           , {re(date_re), QVariant::Date}
+           , {re(time_re), QVariant::Time}
+           , {re(datetime_re), QVariant::DateTime}
+    };
+
+    QVariant v(s);
+    if (!s.size())
+        return v;
+
+    for (auto const& re_type : re_types) {
+        if (re_type.first.exactMatch(s)) {
+            v.convert(re_type.second);
+            break;
+        }
+    }
+    return v;
+}
+
+void ensureSameDecode(QString const &s)
+{
+    auto expected = regexDecode(s);
+    auto actual = statefs::qt::valueDecode(s);
+    auto msg = QString("Decoding '%1': %2 (%3) vs %4 (%5)")
+        .arg(s, expected.typeName(), expected.toString()
+             , actual.typeName(), actual.toString()).toStdString();
+    ensure(msg, expected.type() == actual.type());
+    ensure(msg, expected.isNull() == actual.isNull());
+    ensure(msg, expected == actual);
+}
+
+}
+
+template<> template<>
+void object::test<tid_decode_vs_regex>()
+{
+    static const QStringList samples = {
+        "", " ", "a", "+", "-", ".", "+.", "0", "-0", "+0", "12", " 12 "
+        , "\t-13\n", "+2147483648", "-2147483649", "-9223372036854775808"
+        , "99999999999999999999", "+99999999999999999999", "4294967295"
+        , "4294967296", "9999999999", "01234567890", "0123", "1.", ".5"
+        , "-1.5", "+.5", "1.2.3", "1e3", "2013-01-02", " 2013-01-02"
+        , "2013-13-45", "201-01-02", "20130-01-02", "12:30", "12:30:45"
+        , "12:30:", "1:30", "25:61", "2013-01-02T12:30Z"
+        , "2013-01-02T12:30:45+03:00", "2013-01-02T12:30-03"
+        , "2013-01-02T12:30", "2013-01-02T12:30:45+3", "true", "0x10"
+        , QString::fromUtf8("\xc2\xa0" "42"), QString::fromUtf8("\xd9\xa3")
+    };
+    for (auto const &s : samples)
+        ensureSameDecode(s);
+
+    // pseudo-random strings built from characters significant for
+    // the value syntax
+    static const QString alphabet("0123456789+-.:TZ x");
+    qulonglong seed = 1;
+    auto next = [&seed](uint limit) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return static_cast<uint>(seed >> 33) % limit;
+    };
+    for (int i = 0; i < 100000; ++i) {
+        QString s;
+        auto len = next(16);
+        for (uint j = 0; j < len; ++j)
+            s.append(alphabet[next(alphabet.size())]);
+        ensureSameDecode(s);
+    }
+}
+
+template<> template<>
+void object::test<tid_key_split>()
+{
+    using statefs::qt::Key;
+    using statefs::qt::PropertyKey;
+
+    static constexpr Key charge("Battery.ChargePercentage");
+    static_assert(charge.isValid(), "Key should be valid");
+    static_assert(!Key("NoNamespace").isValid(), "Key should be invalid");
+
+    auto ensureSplit = [](PropertyKey const &key
+                          , QString const &ns, QString const &name) {
+        auto msg = ("Splitting " + key.key()).toStdString();
+        ensure(msg, key.isValid());
+        ensure_equals(msg, key.ns().toStdString(), ns.toStdString());
+        ensure_equals(msg, key.name().toStdString(), name.toStdString());
+    };
+    ensureSplit(charge, "Battery", "ChargePercentage");
+    ensureSplit(Key("/a/b.c"), "a_b", "c");
+    ensureSplit(Key("a.b.c.d"), "a_b_c", "d");
+    ensureSplit(Key("@In.Out"), "@In", "Out");
+    ensureSplit(PropertyKey("Battery.ChargePercentage")
+                , "Battery", "ChargePercentage");
+    ensureSplit(PropertyKey("/a/b.c"), "a_b", "c");
+    ensureSplit(PropertyKey("/a"), "", "a");
+    ensure("Key without namespace", !PropertyKey("NoNamespace").isValid());
+    ensure_equals("Path from key", statefs::qt::getSystemPath(charge)
+              .toStdString()
+              , std::string("/run/state/namespaces/Battery/ChargePercentage"));
+}
+
+template<> template<>
+void object::test<tid_declared_type>()
+{
+    using statefs::qt::valueDecode;
+
+    ensure("Heuristics", valueDecode("0123").type() == QVariant::UInt);
+    auto v = valueDecode("0123", QVariant::String);
+    ensure("String is kept", v.type() == QVariant::String);
+    ensure_equals("String value", v.toString().toStdString()
+                  , std::string("0123"));
+    v = valueDecode(" 12 ", QVariant::Int);
+    ensure("Int", v.type() == QVariant::Int);
+    ensure_equals("Int value", v.toInt(), 12);
+    v = valueDecode("x", QVariant::Double);
+    ensure("Default for wrong value", v.type() == QVariant::Double);
+    ensure_equals("Default value", v.toDouble(), 0.0);
+    v = valueDecode("12", QVariant::Invalid);
+    ensure("Not declared", v.type() == QVariant::UInt);
+
+    statefs::qt::setPropertyType("Test.Declared", QVariant::String);
+    ensure("Declared type", statefs::qt::getPropertyType("/Test/Declared")
+           == QVariant::String);
+    ensure("Not declared type", statefs::qt::getPropertyType("Test.Other")
+           == QVariant::Invalid);
+}
+
+template<> template<>
+void object::test<tid_decode_raw>()
+{
+    using statefs::qt::valueDecodeRaw;
+
+    auto decodeRaw = [](QString const &s, QVariant::Type type) {
+        auto data = s.toUtf8();
+        return valueDecodeRaw(data.constData(), data.size(), type);
+    };
+    static const QStringList samples = {
+        "1", "-13", " 42\n", "+2147483648", "-2147483648", "4294967295"
+        , "01234567890", "3.14", "-.5", "2013-01-02", " 2013-01-02"
+        , "2013-02-30", "12:30:45", "2013-01-02T12:30:45+03:00", "text"
+        , QString::fromUtf8("\xc2\xa0" "42"), QString::fromUtf8("\xd0\xb6")
+    };
+    for (auto type : {QVariant::Invalid, QVariant::String, QVariant::Int
+                , QVariant::UInt, QVariant::Double, QVariant::Date}) {
+        for (auto const &s : samples) {
+            auto expected = statefs::qt::valueDecode(s, type);
+            auto actual = decodeRaw(s, type);
+            auto msg = QString("Decoding raw '%1' as %2: %3 vs %4")
+                .arg(s).arg(type).arg(expected.toString(), actual.toString())
+                .toStdString();
+            ensure(msg, expected.type() == actual.type());
+            ensure(msg, expected == actual);
+        }
+    }
+
+    // steady-state decoding of numeric values should not allocate
+    static const char *numbers[] = {"42", "-13", "3.14", "4294967295"};
+    for (auto s : numbers)
+        valueDecodeRaw(s, strlen(s));
+
+    allocations_count = 0;
+    is_counting_allocations = true;
+    for (int i = 0; i < 1000; ++i) {
+        for (auto s : numbers) {
+            valueDecodeRaw(s, strlen(s));
+            valueDecodeRaw(s, strlen(s), QVariant::Double);
+        }
+    }
+    is_counting_allocations = false;
+    ensure_equals("Allocations while decoding numbers"
+                  , allocations_count.load(), size_t(0));
+}
+
+template<> template<>
+void object::test<tid_encode>()
+{
+    using statefs::qt::valueEncode;
+    using statefs::qt::EncodedValue;
+
+    auto encoded = [](QVariant const &v) {
+        EncodedValue data(v);
+        return std::string(data.data(), data.size());
+    };
+    ensure_equals("Bool", encoded(true), std::string("1"));
+    ensure_equals("Char", encoded(QChar('A')), std::string("65"));
+    ensure_equals("Int", encoded(-2147483647 - 1), std::string("-2147483648"));
+    ensure_equals("UInt", encoded(4294967295u), std::string("4294967295"));
+    ensure_equals("LongLong", encoded(Q_INT64_C(-9223372036854775807) - 1)
+                  , std::string("-9223372036854775808"));
+    ensure_equals("Double", encoded(0.1), std::string("0.1"));
+    ensure_equals("Double integer", encoded(3.0), std::string("3"));
+    ensure_equals("String", encoded(QString::fromUtf8("\xd0\xb6"))
+                  , std::string("\xd0\xb6"));
+    ensure_equals("QString encoding", valueEncode(1.5).toStdString()
+                  , std::string("1.5"));
+
+    // shortest representation should be parsed back to the same value
+    for (auto d : {1.0 / 3, 2.0 / 3, 0.3, 1e-5, 123456.789, -0.5, 1e300}) {
+        auto s = valueEncode(d);
+        ensure_equals("Roundtrip " + s.toStdString(), s.toDouble(), d);
+    }
+
+    static const QVariant numbers[] = {QVariant(42), QVariant(-13)
+                                       , QVariant(3.14), QVariant(true)};
+    allocations_count = 0;
+    is_counting_allocations = true;
+    for (int i = 0; i < 1000; ++i) {
+        for (auto const &v : numbers)
+            EncodedValue data(v);
+    }
+    is_counting_allocations = false;
+    ensure_equals("Allocations while encoding numbers"
+                  , allocations_count.load(), size_t(0));
+}
+
+template<> template<>
+void object::test<tid_blob>()
+{
+    using statefs::qt::Blob;
+    using statefs::qt::blobType;
+    using statefs::qt::valueDecodeRaw;
+    using statefs::qt::EncodedValue;
+
+    Blob parts;
+    parts.append("{\"a\": ");
+    parts.append("");
+    parts.append("[1, 2]}");
+    Blob whole(QByteArray("{\"a\": [1, 2]}"));
+    ensure_equals("Empty chunks are skipped", parts.chunks().size(), 2);
+    ensure_equals("Size", parts.size(), whole.size());
+    ensure("Same data, different chunks", parts == whole);
+    ensure("Joined", parts.toByteArray() == whole.toByteArray());
+    ensure("Shared, not copied", whole.toByteArray().constData()
+           == whole.chunks().front().constData());
+
+    Blob other(QByteArray("{\"a\": [1, 3]}"));
+    ensure("Different data", parts != other);
+    ensure("Empty", Blob() == Blob() && Blob().isEmpty());
+    ensure("Ordered", parts < other && !(other < parts) && !(parts < whole));
+    ensure("Prefix is less", Blob(QByteArray("{")) < parts);
+
+    blobType();
+    ensure("Compared as QVariant", QVariant::fromValue(parts)
+           == QVariant::fromValue(whole));
+    ensure("Different as QVariant", QVariant::fromValue(parts)
+           != QVariant::fromValue(other));
+
+    auto v = valueDecodeRaw("0123", 4, blobType());
+    ensure_equals("Blob type", v.userType(), int(blobType()));
+    ensure("Blob is not decoded", v.value<Blob>() == Blob(QByteArray("0123")));
+    EncodedValue encoded(v);
+    ensure("Blob encoding", encoded == QByteArray("0123"));
+}
+
+template<> template<>
+void object::test<tid_update_allocations>()
+{
+    using statefs::qt::Property;
+    using statefs::qt::Key;
+
+    static const int updates_count = 1000;
+
+    ensure("Temporary dir", root_.isValid());
+    ensure("Short value", setValue("Short", "3.14"));
+    ensure("Long value", setValue("Long", QByteArray(100, 'x')));
+
+    Property short_value(Key("Test.Short"), nullptr);
+    Property long_value(Key("Test.Long"), nullptr);
+    ensure("First short update", short_value.update());
+    ensure("First long update", long_value.update());
+
+    allocations_count = 0;
+    is_counting_allocations = true;
+    for (int i = 0; i < updates_count; ++i) {
+        short_value.update();
+        long_value.update();
+    }
+    is_counting_allocations = false;
+    ensure_equals("Allocations while updating unchanged properties"
+                  , allocations_count.load(), size_t(0));
+}
+
+template<> template<>
+void object::test<tid_delivery_allocations>()
+{
+    static const int warmup_count = 20;
+    static const int changes_count = 50;
+
+    ensure("Temporary dir", root_.isValid());
+    ensure("Initial value", setValue("Delivered", "10"));
+    // values of the same length are written in place without
+    // allocations
+    auto fd = ::open(QFile::encodeName(path("Delivered")).constData()
+                     , O_WRONLY | O_CLOEXEC);
+    ensure("Opened for writing", fd >= 0);
+
+    ContextProperty p("Test.Delivered");
+    p.waitForSubscription(true);
+    QCoreApplication::processEvents();
+
+    int changes = 0;
+    QObject::connect(&p, &ContextProperty::valueChanged
+                     , [&changes]() { ++changes; });
+    auto change = [&](int v) {
+        char data[4];
+        ::snprintf(data, sizeof(data), "%d", v);
+        if (::pwrite(fd, data, 2, 0) != 2)
+            return false;
+        auto expected = changes + 1;
+        for (int i = 0; i < 500 && changes < expected; ++i)
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 10);
+        return changes == expected;
+    };
+
+    // message pools are filled while warming up
+    for (int i = 0; i < warmup_count; ++i)
+        ensure("Warming up", change(11 + i % 2));
+
+    auto delivered = true;
+    allocations_count = 0;
+    is_counting_allocations = true;
+    for (int i = 0; i < changes_count; ++i)
+        delivered = change(11 + i % 2) && delivered;
+    is_counting_allocations = false;
+    ::close(fd);
+    ensure("Changes are delivered", delivered);
+    ensure_equals("Allocations while delivering changes"
+                  , allocations_count.load(), size_t(0));
+}
+
+}
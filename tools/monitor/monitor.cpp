@@ -15,6 +15,7 @@
 #include <QSocketNotifier>
 #include <qtaround/debug.hpp>
 #include <statefs/qt/client.hpp>
+#include <statefs/qt/snapshot.hpp>
 
 namespace debug = qtaround::debug;
 
@@ -31,6 +32,8 @@ void onExit(int)
 int usage(QStringList const &args, int rc)
 {
     qDebug() << "Usage: " << args[0] << " <namespace_path>...";
+    qDebug() << "       " << args[0] << " -w <key> <value>";
+    qDebug() << "       " << args[0] << " -s <namespace>";
     return rc;
 }
 
@@ -58,6 +61,19 @@ void monitorProps(QStringList keys)
     }
 }
 
+int dumpSnapshot(QString const &ns)
+{
+    auto snapshot = statefs::qt::Snapshot::read(ns);
+    auto const &values = snapshot.values();
+    for (auto it = values.begin(); it != values.end(); ++it)
+        debug::print(it.key(), "=", it.value());
+    auto const &stats = snapshot.stats();
+    debug::info("Read", stats.count, "properties in"
+                , (stats.list_ns + stats.read_ns) / 1000, "us, threads:"
+                , stats.threads, "failed:", stats.failed);
+    return snapshot.isEmpty() ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
@@ -66,6 +82,12 @@ int main(int argc, char *argv[])
     if (args.size() <= 1)
         return usage(args, -1);
 
+    if (args[1] == "-s") {
+        if (args.size() <= 2)
+            return usage(args, -1);
+        return dumpSnapshot(args[2]);
+    }
+
     ::socketpair(AF_UNIX, SOCK_STREAM, 0, sigFd);
     sigNot = new QSocketNotifier(sigFd[1], QSocketNotifier::Read, &app);
     app.connect(sigNot, &QSocketNotifier::activated, []() {